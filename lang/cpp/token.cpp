@@ -0,0 +1,72 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "../../src/cli/chunking.h"
+
+// Counts tokens the way the chunkers' --tokens mode does, to size chunks or
+// check a chunk before pasting it:
+//   token [--vocab=FILE] [file...]
+// Without a file it reads stdin.
+
+static bool readAll(std::istream& in, std::string& text) {
+    std::vector<char> buffer(1 << 20);
+    while (in.read(buffer.data(), buffer.size()) || in.gcount() > 0)
+        text.append(buffer.data(), in.gcount());
+    return !in.bad();
+}
+
+int main(int argc, char* argv[]) {
+    std::string vocabulary_path;
+    std::vector<std::string> files;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            std::cout << "Usage: " << argv[0] << " [--vocab=FILE] [file...]" << std::endl;
+            std::cout << "  Prints the token count of each file (default: stdin). Without" << std::endl;
+            std::cout << "  --vocab the count is estimated from word lengths; with a tiktoken" << std::endl;
+            std::cout << "  vocabulary (e.g. cl100k_base.tiktoken) pieces are BPE-merged." << std::endl;
+            return 0;
+        } else if (arg.compare(0, 8, "--vocab=") == 0) {
+            vocabulary_path = arg.substr(8);
+        } else {
+            files.push_back(arg);
+        }
+    }
+
+    std::shared_ptr<const TokenRanks> vocabulary;
+    if (!vocabulary_path.empty() && !(vocabulary = Tokenizer::loadVocabulary(vocabulary_path))) {
+        std::cerr << "Error: Could not read a vocabulary from " << vocabulary_path << std::endl;
+        return 1;
+    }
+    Tokenizer tokenizer(vocabulary);
+
+    if (files.empty()) {
+        std::string text;
+        if (!readAll(std::cin, text)) {
+            std::cerr << "Error: Could not read stdin" << std::endl;
+            return 1;
+        }
+        std::cout << tokenizer.countTokens(text) << std::endl;
+        return 0;
+    }
+
+    int status = 0;
+    size_t total = 0;
+    for (const std::string& name : files) {
+        std::ifstream file(name, std::ios::binary);
+        std::string text;
+        if (!file || !readAll(file, text)) {
+            std::cerr << "Error: Could not read " << name << std::endl;
+            status = 1;
+            continue;
+        }
+        size_t count = tokenizer.countTokens(text);
+        total += count;
+        std::cout << count << "\t" << name << std::endl;
+    }
+    if (files.size() > 1) std::cout << total << "\ttotal" << std::endl;
+    return status;
+}
@@ -0,0 +1,1499 @@
+// Pieces shared by the command-line chunkers (cli.cpp, xcli.cpp) and the
+// token counter (lang/cpp/token.cpp): input files, the /tmp journal, command
+// input, UTF-8 scanning, token counting, the --boundary break search, the
+// chunk layout and --follow. Each frontend keeps its own clipboard and
+// TextChunker, which derives from ChunkLayout. The GUI (gui.cpp) uses the
+// file mapping.
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Read-only mapping of an input file. Pages are faulted in on first access,
+// so opening a multi-GB file costs little more than the open() itself.
+class MappedFile {
+private:
+    int fd;
+    char* data;
+    size_t length;
+
+public:
+    MappedFile() : fd(-1), data(nullptr), length(0) {}
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const std::string& filename) {
+        close();
+        fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            close(); // pipes and devices can't be mapped
+            return false;
+        }
+
+        length = st.st_size;
+        if (length > 0) {
+            void* addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED) {
+                close();
+                return false;
+            }
+            data = static_cast<char*>(addr);
+        }
+        return true;
+    }
+
+    void close() {
+        if (data) munmap(data, length);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        data = nullptr;
+        length = 0;
+    }
+
+    bool isOpen() const { return fd >= 0; }
+    int descriptor() const { return fd; }
+    std::string_view view() const { return std::string_view(data, length); }
+};
+
+// Pages through a file with pread instead of holding it in memory. Only the
+// last few chunk-sized windows stay resident, so inputs larger than RAM work.
+// Text appended during the session goes to a second, writable segment.
+class StreamReader {
+private:
+    struct Segment {
+        int fd;
+        uint64_t length;
+        bool writable;
+    };
+
+    struct Window {
+        uint64_t start = 0;
+        std::string data;
+        unsigned long last_use = 0; // 0 = empty
+    };
+
+    static constexpr size_t kWindowCount = 3; // current, previous and next chunk
+
+    std::vector<Segment> segments;
+    uint64_t total_length;
+    Window windows[kWindowCount];
+    unsigned long use_clock;
+
+    bool readAt(uint64_t offset, char* out, size_t length) {
+        for (const Segment& segment : segments) {
+            if (length == 0) break;
+            if (offset >= segment.length) {
+                offset -= segment.length;
+                continue;
+            }
+            size_t take = std::min<uint64_t>(length, segment.length - offset);
+            size_t done = 0;
+            while (done < take) {
+                ssize_t n = pread(segment.fd, out + done, take - done, offset + done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                done += n;
+            }
+            out += take;
+            length -= take;
+            offset = 0;
+        }
+        return length == 0;
+    }
+
+public:
+    StreamReader() : total_length(0), use_clock(0) {}
+    ~StreamReader() { close(); }
+
+    StreamReader(const StreamReader&) = delete;
+    StreamReader& operator=(const StreamReader&) = delete;
+
+    bool open(const std::string& filename) {
+        close();
+        int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ::close(fd);
+            return false;
+        }
+        segments.push_back({fd, static_cast<uint64_t>(st.st_size), false});
+        total_length = st.st_size;
+        return true;
+    }
+
+    // Copies input_fd (e.g. stdin) to spool_path in bounded blocks and pages
+    // from the copy; later appends extend the spool file directly
+    bool spool(int input_fd, const std::string& spool_path) {
+        close();
+        int fd = ::open(spool_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) return false;
+        segments.push_back({fd, 0, true});
+
+        std::vector<char> buffer(1 << 20);
+        while (true) {
+            ssize_t n = ::read(input_fd, buffer.data(), buffer.size());
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 || (n > 0 && !append(std::string_view(buffer.data(), n), spool_path))) {
+                close();
+                return false;
+            }
+            if (n == 0) return true;
+        }
+    }
+
+    // Appends to the writable segment, creating one at overflow_path if the
+    // input itself is read-only. Cached windows stay valid: the text is
+    // append-only and windows are keyed by their exact range.
+    bool append(std::string_view data, const std::string& overflow_path) {
+        if (segments.empty() || !segments.back().writable) {
+            int fd = ::open(overflow_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (fd < 0) return false;
+            segments.push_back({fd, 0, true});
+        }
+
+        Segment& segment = segments.back();
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = pwrite(segment.fd, data.data() + done, data.size() - done,
+                               segment.length + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            done += n;
+        }
+        segment.length += data.size();
+        total_length += data.size();
+        return true;
+    }
+
+    // View of [start, start + length). It stays valid until two other ranges
+    // have been read; an empty view means the read failed.
+    std::string_view read(uint64_t start, size_t length) {
+        Window* victim = &windows[0];
+        for (Window& window : windows) {
+            if (window.last_use && window.start == start && window.data.size() == length) {
+                window.last_use = ++use_clock;
+                return window.data;
+            }
+            if (window.last_use < victim->last_use) victim = &window;
+        }
+
+        victim->data.resize(length);
+        if (!readAt(start, victim->data.data(), length)) {
+            victim->last_use = 0;
+            return std::string_view();
+        }
+        victim->start = start;
+        victim->last_use = ++use_clock;
+        return victim->data;
+    }
+
+    void close() {
+        for (const Segment& segment : segments) ::close(segment.fd);
+        segments.clear();
+        total_length = 0;
+        for (Window& window : windows) window = Window();
+    }
+
+    // Picks up growth of a read-only input file, provided nothing has been
+    // appended after it; returns false if there is nothing to pick up that way
+    bool refresh() {
+        if (segments.size() != 1 || segments[0].writable) return false;
+
+        struct stat st;
+        if (fstat(segments[0].fd, &st) != 0) return false;
+        uint64_t length = st.st_size;
+        if (length <= segments[0].length) return false;
+
+        total_length += length - segments[0].length;
+        segments[0].length = length;
+        return true;
+    }
+
+    bool isOpen() const { return !segments.empty(); }
+    uint64_t size() const { return total_length; }
+};
+
+// writev() until everything is written or an error occurs
+inline bool writeAll(int out_fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t n = ::writev(out_fd, iov, count);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        // Skip what was written, including a partially written buffer
+        while (count > 0 && static_cast<size_t>(n) >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+// Writes the /tmp snapshot on a dedicated thread so the interactive loop
+// never waits on disk. The snapshot is an append-only journal: the text is
+// written once, then only the pieces appended to it. Everything queued while
+// the thread is busy is coalesced into a single writev(), and the file is
+// only fdatasync()ed on close. Text the caller keeps anyway is written from
+// the caller's buffer instead of a copy (appendBorrowed).
+class SnapshotWriter {
+private:
+    struct Entry {
+        std::string data;
+        std::string_view borrowed;  // Written if data is empty; owned by the caller
+        int source_fd = -1;         // If set, copy source_length bytes of this file
+        uint64_t source_length = 0;
+    };
+
+    std::string path;
+    int fd;
+    bool failed;
+    bool background;
+    std::deque<Entry> pending;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    uint64_t queued;            // Entries handed to the writer thread
+    uint64_t written;           // ...and those it is done with
+    bool stopping;
+    std::thread worker;
+
+    // File-to-file copy inside the kernel; no user-space buffer
+    static bool copyFile(int out_fd, int in_fd, uint64_t length) {
+        off_t offset = 0;
+        while (static_cast<uint64_t>(offset) < length) {
+            ssize_t n = sendfile(out_fd, in_fd, &offset, length - offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+        }
+        return true;
+    }
+
+    void writeBatch(std::deque<Entry>& batch) {
+        if (fd < 0 && !failed) {
+            // Only one thread writes, sequentially; sendfile() rejects O_APPEND
+            fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            failed = (fd < 0);
+        }
+
+        std::vector<struct iovec> iov;
+        size_t i = 0;
+        while (i < batch.size() && !failed) {
+            if (batch[i].source_fd >= 0) {
+                failed = !copyFile(fd, batch[i].source_fd, batch[i].source_length);
+                i++;
+                continue;
+            }
+            // Consecutive text entries go out in one system call
+            iov.clear();
+            while (i < batch.size() && batch[i].source_fd < 0 && iov.size() < IOV_MAX) {
+                const Entry& entry = batch[i];
+                std::string_view bytes = entry.data.empty() ? entry.borrowed : std::string_view(entry.data);
+                iov.push_back({const_cast<char*>(bytes.data()), bytes.size()});
+                i++;
+            }
+            failed = !writeAll(fd, iov.data(), iov.size());
+        }
+        if (failed && i > 0) {
+            std::cerr << "Error: Could not write to " << path << std::endl;
+        }
+
+        for (const Entry& entry : batch) {
+            if (entry.source_fd >= 0) ::close(entry.source_fd);
+        }
+    }
+
+    void run() {
+        std::deque<Entry> batch;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || !pending.empty(); });
+            if (pending.empty()) break; // stopping, and everything is written
+
+            batch.swap(pending);
+            lock.unlock();
+            writeBatch(batch);
+            size_t count = batch.size();
+            batch.clear();
+            lock.lock();
+            written += count;
+            idle.notify_all();
+        }
+    }
+
+    void push(Entry entry) {
+        if (!background) {
+            std::deque<Entry> batch;
+            batch.push_back(std::move(entry));
+            writeBatch(batch);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back(std::move(entry));
+            queued++;
+        }
+        wake.notify_one();
+    }
+
+public:
+    SnapshotWriter() : fd(-1), failed(false), background(true), queued(0), written(0), stopping(false) {}
+    ~SnapshotWriter() { close(); }
+
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    // With in_background false, writes happen synchronously in the caller
+    void open(const std::string& snapshot_path, bool in_background = true) {
+        close();
+        path = snapshot_path;
+        failed = false;
+        background = in_background;
+        stopping = false;
+        if (background) worker = std::thread(&SnapshotWriter::run, this);
+    }
+
+    bool isOpen() const { return !path.empty(); }
+
+    void append(std::string data) {
+        Entry entry;
+        entry.data = std::move(data);
+        push(std::move(entry));
+    }
+
+    // Journals data without copying it: the caller must keep the bytes alive
+    // and unchanged until wait() or close() returns
+    void appendBorrowed(std::string_view data) {
+        Entry entry;
+        entry.borrowed = data;
+        push(std::move(entry));
+    }
+
+    // Blocks until everything queued so far has been written
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this] { return written == queued; });
+    }
+
+    // Journals the first length bytes of in_fd; takes ownership of the descriptor
+    void appendFile(int in_fd, uint64_t length) {
+        Entry entry;
+        entry.source_fd = in_fd;
+        entry.source_length = length;
+        push(std::move(entry));
+    }
+
+    // Finishes pending writes, stops the writer thread and syncs the file
+    void close() {
+        if (worker.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            worker.join();
+        }
+        if (fd >= 0) {
+            fdatasync(fd);
+            ::close(fd);
+        }
+        fd = -1;
+        path.clear();
+    }
+};
+
+// Commands are read from stdin; once stdin has been consumed as input text,
+// switch it over to the controlling terminal
+inline bool reattachTerminal() {
+    int tty = ::open("/dev/tty", O_RDONLY | O_CLOEXEC);
+    if (tty < 0) return false;
+    bool ok = dup2(tty, STDIN_FILENO) >= 0;
+    ::close(tty);
+    return ok;
+}
+
+// Parses a command-line number: only decimal digits, at most max_digits of
+// them, so signs, spaces, trailing text and overflow are all rejected
+inline bool parseNumber(std::string_view text, size_t max_digits, size_t& value) {
+    if (text.empty() || text.size() > max_digits) return false;
+    size_t number = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') return false;
+        number = number * 10 + (c - '0');
+    }
+    value = number;
+    return true;
+}
+
+// Reads command lines from stdin directly, rather than through std::cin, so
+// it can also wait on other descriptors (the inotify watch in follow mode)
+// and service them while the user is at the prompt.
+class CommandInput {
+private:
+    struct Watch {
+        int fd;
+        std::function<void()> on_ready;
+    };
+    
+    std::string buffer;
+    bool at_eof;
+    std::vector<Watch> watches;
+
+public:
+    CommandInput() : at_eof(false) {}
+
+    // on_ready is called whenever fd becomes readable while waiting for input
+    void watch(int fd, std::function<void()> on_ready) {
+        watches.push_back({fd, std::move(on_ready)});
+    }
+
+    // Reads one line without its newline. Returns false at end of input.
+    bool readLine(std::string& line) {
+        line.clear();
+        std::vector<struct pollfd> fds(1 + watches.size());
+        fds[0] = {STDIN_FILENO, POLLIN, 0};
+        for (size_t i = 0; i < watches.size(); i++) {
+            fds[i + 1] = {watches[i].fd, POLLIN, 0};
+        }
+        
+        while (true) {
+            size_t newline = buffer.find('\n');
+            if (newline != std::string::npos) {
+                line.assign(buffer, 0, newline);
+                buffer.erase(0, newline + 1);
+                return true;
+            }
+            if (at_eof) {
+                line.swap(buffer);
+                buffer.clear();
+                return !line.empty();
+            }
+
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno != EINTR) at_eof = true;
+                continue;
+            }
+
+            for (size_t i = 0; i < watches.size(); i++) {
+                if (fds[i + 1].revents & POLLIN) {
+                    watches[i].on_ready();
+                }
+            }
+            if (fds[0].revents) {
+                char chunk[4096];
+                ssize_t n = ::read(STDIN_FILENO, chunk, sizeof(chunk));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    at_eof = true;
+                } else {
+                    buffer.append(chunk, n);
+                }
+            }
+        }
+    }
+};
+
+// UTF-8 scanning for chunk boundaries. Every byte that is not a continuation
+// byte (10xxxxxx) starts a codepoint, so counting codepoints means counting
+// those bytes: with AVX2, one compare and popcount per 32 bytes. The AVX2
+// paths are chosen at run time, so the binary still runs on any x86-64 CPU.
+class Utf8 {
+public:
+    static bool isContinuation(char c) {
+        return (static_cast<unsigned char>(c) & 0xC0) == 0x80;
+    }
+    
+    static size_t countCodepoints(const char* data, size_t length) {
+        #if defined(__x86_64__)
+        if (hasAvx2()) return countCodepointsAvx2(data, length);
+        #endif
+        return countCodepointsScalar(data, length);
+    }
+    
+    // Offset of the codepoint that has count codepoints before it, or length
+    // if data holds no more than that
+    static size_t skipCodepoints(const char* data, size_t length, size_t count) {
+        #if defined(__x86_64__)
+        if (hasAvx2()) return skipCodepointsAvx2(data, length, count);
+        #endif
+        return skipCodepointsScalar(data, length, count);
+    }
+    
+    // Well-formed UTF-8: no stray continuation bytes, overlong forms,
+    // surrogates or values past U+10FFFF
+    static bool isValid(const char* data, size_t length) {
+        #if defined(__x86_64__)
+        if (hasAvx2()) return isValidAvx2(data, length);
+        #endif
+        return isValidScalar(data, length);
+    }
+    
+private:
+    static size_t countCodepointsScalar(const char* data, size_t length) {
+        size_t count = 0;
+        for (size_t i = 0; i < length; i++) {
+            count += !isContinuation(data[i]);
+        }
+        return count;
+    }
+    
+    static bool isValidScalar(const char* data, size_t length) {
+        static const uint32_t min_value[] = {0, 0, 0x80, 0x800, 0x10000};
+        size_t i = 0;
+        while (i < length) {
+            unsigned char c = data[i];
+            if (c < 0x80) {
+                i++;
+                continue;
+            }
+            
+            size_t size;
+            uint32_t value;
+            if ((c & 0xE0) == 0xC0) {
+                size = 2;
+                value = c & 0x1F;
+            } else if ((c & 0xF0) == 0xE0) {
+                size = 3;
+                value = c & 0x0F;
+            } else if ((c & 0xF8) == 0xF0) {
+                size = 4;
+                value = c & 0x07;
+            } else {
+                return false;
+            }
+            if (length - i < size) return false;
+            
+            for (size_t k = 1; k < size; k++) {
+                if (!isContinuation(data[i + k])) return false;
+                value = (value << 6) | (data[i + k] & 0x3F);
+            }
+            if (value < min_value[size] || value > 0x10FFFF || (value >= 0xD800 && value <= 0xDFFF)) {
+                return false;
+            }
+            i += size;
+        }
+        return true;
+    }
+    
+    static size_t skipCodepointsScalar(const char* data, size_t length, size_t count) {
+        for (size_t i = 0; i < length; i++) {
+            if (isContinuation(data[i])) continue;
+            if (count == 0) return i;
+            count--;
+        }
+        return length;
+    }
+    
+    #if defined(__x86_64__)
+    static bool hasAvx2() {
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+    }
+    
+    // Bit i is set if byte i of the block starts a codepoint. As signed
+    // bytes, continuation bytes are exactly those below -64.
+    __attribute__((target("avx2")))
+    static uint32_t leadMask(const char* block) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+        __m256i leads = _mm256_cmpgt_epi8(bytes, _mm256_set1_epi8(static_cast<char>(0xBF)));
+        return _mm256_movemask_epi8(leads);
+    }
+    
+    __attribute__((target("avx2,popcnt")))
+    static size_t countCodepointsAvx2(const char* data, size_t length) {
+        size_t count = 0;
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32) {
+            count += _mm_popcnt_u32(leadMask(data + i));
+        }
+        return count + countCodepointsScalar(data + i, length - i);
+    }
+    
+    __attribute__((target("avx2,popcnt,bmi")))
+    static size_t skipCodepointsAvx2(const char* data, size_t length, size_t count) {
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32) {
+            uint32_t mask = leadMask(data + i);
+            size_t leads = _mm_popcnt_u32(mask);
+            if (count < leads) {
+                while (count--) mask &= mask - 1; // drop the leads before it
+                return i + _tzcnt_u32(mask);
+            }
+            count -= leads;
+        }
+        return i + skipCodepointsScalar(data + i, length - i, count);
+    }
+    
+    // Validates 32 bytes per step with the lookup-table method of Keiser and
+    // Lemire ("Validating UTF-8 in less than one instruction per byte"):
+    // three table lookups on the nibbles of each byte and the byte before it
+    // flag every invalid two-byte pattern, and the 3- and 4-byte sequences
+    // are checked by where continuation bytes must appear.
+    __attribute__((target("avx2")))
+    static bool isValidAvx2(const char* data, size_t length) {
+        const uint8_t too_short = 1 << 0, too_long = 1 << 1, overlong_3 = 1 << 2, too_large = 1 << 3,
+                      surrogate = 1 << 4, overlong_2 = 1 << 5, too_large_1000 = 1 << 6,
+                      overlong_4 = 1 << 6, two_conts = 1 << 7;
+        const uint8_t carry = too_short | too_long | two_conts;
+        
+        const __m256i byte_1_high = _mm256_setr_epi8(
+            too_long, too_long, too_long, too_long, too_long, too_long, too_long, too_long,
+            two_conts, two_conts, two_conts, two_conts,
+            too_short | overlong_2, too_short, too_short | overlong_3 | surrogate,
+            too_short | too_large | too_large_1000 | overlong_4,
+            too_long, too_long, too_long, too_long, too_long, too_long, too_long, too_long,
+            two_conts, two_conts, two_conts, two_conts,
+            too_short | overlong_2, too_short, too_short | overlong_3 | surrogate,
+            too_short | too_large | too_large_1000 | overlong_4);
+        const uint8_t large = carry | too_large | too_large_1000;
+        const __m256i byte_1_low = _mm256_setr_epi8(
+            carry | overlong_3 | overlong_2 | overlong_4, carry | overlong_2, carry, carry,
+            carry | too_large, large, large, large,
+            large, large, large, large, large, large | surrogate, large, large,
+            carry | overlong_3 | overlong_2 | overlong_4, carry | overlong_2, carry, carry,
+            carry | too_large, large, large, large,
+            large, large, large, large, large, large | surrogate, large, large);
+        const uint8_t cont_1000 = too_long | overlong_2 | two_conts | overlong_3 | too_large_1000 | overlong_4;
+        const uint8_t cont_1001 = too_long | overlong_2 | two_conts | overlong_3 | too_large;
+        const uint8_t cont_101 = too_long | overlong_2 | two_conts | surrogate | too_large;
+        const __m256i byte_2_high = _mm256_setr_epi8(
+            too_short, too_short, too_short, too_short, too_short, too_short, too_short, too_short,
+            cont_1000, cont_1001, cont_101, cont_101, too_short, too_short, too_short, too_short,
+            too_short, too_short, too_short, too_short, too_short, too_short, too_short, too_short,
+            cont_1000, cont_1001, cont_101, cont_101, too_short, too_short, too_short, too_short);
+        // A block ending in the first bytes of a sequence needs the next block
+        const __m256i incomplete_above = _mm256_setr_epi8(
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+        const __m256i nibble = _mm256_set1_epi8(0x0F);
+        
+        __m256i error = _mm256_setzero_si256();
+        __m256i previous = _mm256_setzero_si256();
+        __m256i previous_incomplete = _mm256_setzero_si256();
+        
+        char last[32] = {};
+        for (size_t i = 0; i < length; i += 32) {
+            const char* block = data + i;
+            if (length - i < 32) {
+                memcpy(last, block, length - i);
+                block = last;
+            }
+            __m256i input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block));
+            
+            if (_mm256_movemask_epi8(input) == 0) {
+                error = _mm256_or_si256(error, previous_incomplete);
+                previous_incomplete = _mm256_setzero_si256();
+            } else {
+                // The input shifted right by 1..3 bytes, continuing from the previous block
+                __m256i carried = _mm256_permute2x128_si256(previous, input, 0x21);
+                __m256i prev1 = _mm256_alignr_epi8(input, carried, 15);
+                __m256i prev2 = _mm256_alignr_epi8(input, carried, 14);
+                __m256i prev3 = _mm256_alignr_epi8(input, carried, 13);
+                
+                __m256i special = _mm256_and_si256(
+                    _mm256_and_si256(
+                        _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                        _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+                    _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+                
+                // Bytes two after a 3- or 4-byte lead, or three after a
+                // 4-byte lead, must be continuations; two_conts says they are
+                __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+                __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+                __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth),
+                                                         _mm256_set1_epi8(static_cast<char>(0x80)));
+                error = _mm256_or_si256(error, _mm256_xor_si256(must_continue, special));
+                previous_incomplete = _mm256_subs_epu8(input, incomplete_above);
+            }
+            previous = input;
+        }
+        error = _mm256_or_si256(error, previous_incomplete);
+        return _mm256_testz_si256(error, error);
+    }
+    
+    #endif
+};
+
+// Ranks of the tokens of a BPE vocabulary, looked up by their bytes
+class TokenRanks {
+private:
+    std::deque<std::string> tokens; // Keys of ranks point into these
+    std::unordered_map<std::string_view, uint32_t> ranks;
+    
+public:
+    void add(std::string token, uint32_t rank) {
+        tokens.push_back(std::move(token));
+        ranks[tokens.back()] = rank;
+    }
+    
+    // UINT32_MAX if bytes is not a token
+    uint32_t rank(std::string_view bytes) const {
+        auto it = ranks.find(bytes);
+        return (it == ranks.end()) ? UINT32_MAX : it->second;
+    }
+    
+    size_t size() const { return ranks.size(); }
+};
+
+// Token counting for --tokens. Text is split into pieces roughly the way
+// GPT-style tokenizers pre-tokenize it: words with the character before
+// them, up to three digits, punctuation runs, whitespace. No token crosses
+// a piece, so chunks end between pieces. With a vocabulary loaded (--vocab)
+// each piece is counted by applying BPE merges in rank order, with counts
+// cached per piece since most text repeats its words; otherwise the count
+// is estimated from the piece's length and script.
+class Tokenizer {
+private:
+    enum Class : uint8_t { Letter, Digit, Space, Newline, Other };
+    
+    std::shared_ptr<const TokenRanks> ranks;
+    // Token counts of recent pieces by content hash, one per slot: a lookup
+    // is one probe, and pieces that don't repeat just replace each other
+    std::vector<std::pair<uint64_t, uint32_t>> cache;
+    
+    // Bytes of non-ASCII characters count as letters: most are, and it keeps
+    // multibyte characters inside one piece
+    static constexpr std::array<Class, 256> classTable() {
+        std::array<Class, 256> classes{};
+        for (int b = 0; b < 256; b++) {
+            if ((b >= 'a' && b <= 'z') || (b >= 'A' && b <= 'Z') || b >= 0x80) classes[b] = Letter;
+            else if (b >= '0' && b <= '9') classes[b] = Digit;
+            else if (b == ' ' || b == '\t' || b == '\v' || b == '\f') classes[b] = Space;
+            else if (b == '\n' || b == '\r') classes[b] = Newline;
+            else classes[b] = Other;
+        }
+        return classes;
+    }
+    
+    static Class classOf(char c) {
+        static constexpr std::array<Class, 256> table = classTable();
+        return table[static_cast<unsigned char>(c)];
+    }
+    
+    static bool isWhitespace(char c) {
+        Class type = classOf(c);
+        return type == Space || type == Newline;
+    }
+    
+    // Without a vocabulary: one token per short English word, longer words
+    // and other scripts by their length, close to what cl100k-style
+    // vocabularies give on average
+    static size_t estimate(std::string_view piece) {
+        switch (classOf(piece.back())) {
+            case Letter: {
+                // In tenths of a token: ASCII letters 1, two-byte characters
+                // (Latin, Cyrillic, Greek...) 3.5, CJK 7, the rest 14
+                static constexpr auto weights = []() {
+                    std::array<uint8_t, 256> units{};
+                    for (int b = 'a'; b <= 'z'; b++) units[b] = units[b - 'a' + 'A'] = 10;
+                    for (int b = 0xC0; b < 0x100; b++) units[b] = (b < 0xE0) ? 35 : (b < 0xF0) ? 70 : 140;
+                    return units;
+                }();
+                size_t units = 0;
+                for (char c : piece) units += weights[static_cast<unsigned char>(c)];
+                return 1 + (std::max<size_t>(units, 1) - 1) / 70;
+            }
+            case Space:
+            case Newline:
+                return 1 + (piece.size() - 1) / 16;
+            default:
+                return 1 + (piece.size() - 1) / 3;
+        }
+    }
+    
+    // Byte-pair merges as tiktoken does them: repeatedly join the adjacent
+    // parts whose concatenation has the lowest rank. Each part keeps the
+    // rank of joining it with the next, so a merge only looks up the pairs
+    // next to it.
+    size_t mergeCount(std::string_view piece) const {
+        std::vector<std::pair<size_t, uint32_t>> parts; // Start, rank of joining the next part
+        parts.reserve(piece.size() + 1);
+        for (size_t i = 0; i < piece.size(); i++) {
+            parts.emplace_back(i, (i + 1 < piece.size()) ? ranks->rank(piece.substr(i, 2)) : UINT32_MAX);
+        }
+        parts.emplace_back(piece.size(), UINT32_MAX);
+        
+        // Rank of joining parts i, i + 1 and i + 2, which is what part i
+        // joins with once i and i + 1 are merged
+        auto rankAfterMerge = [&](size_t i) {
+            if (i + 3 >= parts.size()) return UINT32_MAX;
+            return ranks->rank(piece.substr(parts[i].first, parts[i + 3].first - parts[i].first));
+        };
+        
+        while (parts.size() > 2) {
+            size_t best = 0;
+            for (size_t i = 1; i + 1 < parts.size(); i++) {
+                if (parts[i].second < parts[best].second) best = i;
+            }
+            if (parts[best].second == UINT32_MAX) break;
+            
+            parts[best].second = rankAfterMerge(best);
+            if (best > 0) parts[best - 1].second = rankAfterMerge(best - 1);
+            parts.erase(parts.begin() + best + 1);
+        }
+        return parts.size() - 1;
+    }
+    
+public:
+    explicit Tokenizer(std::shared_ptr<const TokenRanks> vocabulary = nullptr) : ranks(std::move(vocabulary)) {}
+    
+    // Reads a tiktoken vocabulary: one "<base64 token> <rank>" per line,
+    // as in cl100k_base.tiktoken. Returns null if the file has no tokens.
+    static std::shared_ptr<const TokenRanks> loadVocabulary(const std::string& path) {
+        std::ifstream file(path);
+        if (!file) return nullptr;
+    
+        static const auto decode = []() {
+            std::array<int8_t, 256> values;
+            values.fill(-1);
+            const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            for (int i = 0; i < 64; i++) values[static_cast<unsigned char>(alphabet[i])] = i;
+            return values;
+        }();
+    
+        auto vocabulary = std::make_shared<TokenRanks>();
+        std::string line;
+        while (std::getline(file, line)) {
+            size_t space = line.find(' ');
+            if (space == std::string::npos || space == 0) continue;
+    
+            std::string token;
+            uint32_t bits = 0;
+            int count = 0;
+            for (size_t i = 0; i < space && line[i] != '='; i++) {
+                int value = decode[static_cast<unsigned char>(line[i])];
+                if (value < 0) break;
+                bits = (bits << 6) | value;
+                count += 6;
+                if (count >= 8) {
+                    count -= 8;
+                    token += static_cast<char>((bits >> count) & 0xFF);
+                }
+            }
+            vocabulary->add(std::move(token), std::strtoul(line.c_str() + space + 1, nullptr, 10));
+        }
+        if (vocabulary->size() == 0) return nullptr;
+        return vocabulary;
+    }
+    
+    // Length of the piece at the start of text, which is not empty
+    static size_t pieceLength(std::string_view text) {
+        size_t size = text.size();
+        char first = text[0];
+        Class type = classOf(first);
+    
+        // Contractions: 's 'd 'm 't 'll 've 're
+        if (first == '\'' && size > 1) {
+            char next = tolower(text[1]);
+            if (next == 's' || next == 'd' || next == 'm' || next == 't') return 2;
+            char after = (size > 2) ? tolower(text[2]) : 0;
+            if ((next == 'l' && after == 'l') || (next == 'v' && after == 'e') || (next == 'r' && after == 'e')) {
+                return 3;
+            }
+        }
+    
+        size_t i = 1;
+        switch (type) {
+            case Letter:
+                while (i < size && classOf(text[i]) == Letter) i++;
+                return i;
+            case Digit:
+                while (i < 3 && i < size && classOf(text[i]) == Digit) i++;
+                return i;
+            default:
+                break;
+        }
+    
+        // One space or punctuation character before a word joins it
+        if (type != Newline && size > 1 && classOf(text[1]) == Letter) {
+            while (i < size && classOf(text[i]) == Letter) i++;
+            return i;
+        }
+    
+        if (type == Other || (first == ' ' && size > 1 && classOf(text[1]) == Other)) {
+            while (i < size && classOf(text[i]) == Other) i++;
+            while (i < size && classOf(text[i]) == Newline) i++;
+            return i;
+        }
+    
+        // Whitespace: up to its last line break, else all of it but a space
+        // that starts the next word
+        size_t end = 0;
+        while (end < size && isWhitespace(text[end])) end++;
+        for (size_t j = end; j > 0; j--) {
+            if (classOf(text[j - 1]) == Newline) return j;
+        }
+        return (end < size && end > 1) ? end - 1 : end;
+    }
+    
+    size_t countPiece(std::string_view piece) {
+        if (!ranks) return estimate(piece);
+    
+        // Long pieces rarely repeat, so they skip the cache. Merging is
+        // quadratic in the piece, so very long ones are merged in segments.
+        if (piece.size() > 32) {
+            size_t count = 0;
+            while (piece.size() > 256) {
+                size_t cut = 256;
+                while (cut > 0 && (static_cast<unsigned char>(piece[cut]) & 0xC0) == 0x80) cut--;
+                if (cut == 0) cut = 256;
+                count += mergeCount(piece.substr(0, cut));
+                piece.remove_prefix(cut);
+            }
+            return count + mergeCount(piece);
+        }
+        if (cache.empty()) cache.resize(1 << 16);
+        uint64_t hash = std::hash<std::string_view>{}(piece) | 1;
+        auto& slot = cache[hash & (cache.size() - 1)];
+        if (slot.first != hash) {
+            slot.first = hash;
+            slot.second = (ranks->rank(piece) != UINT32_MAX) ? 1 : mergeCount(piece);
+        }
+        return slot.second;
+    }
+    
+    size_t countTokens(std::string_view text) {
+        size_t count = 0;
+        for (size_t i = 0; i < text.size(); ) {
+            size_t size = pieceLength(text.substr(i));
+            count += countPiece(text.substr(i, size));
+            i += size;
+        }
+        return count;
+    }
+};
+
+// Where a chunk may end besides its size limit (--boundary). A chunk ends
+// after the last break of its kind in the final slack percent of the chunk;
+// paragraph and sentence modes fall back to a line break, and every mode
+// falls back to the plain size limit.
+enum class BoundaryMode { Fixed, Line, Paragraph, Sentence };
+
+// Finds the breaks that --boundary ends chunks at
+class Breaks {
+private:
+    static bool isBlank(char c) {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+    
+    // First byte of a sentence terminator, or the lead byte of a CJK one
+    static bool mayEndSentence(char c) {
+        return c == '.' || c == '!' || c == '?' || c == '\xE3' || c == '\xEF';
+    }
+    
+    // Offset just past a sentence end starting at text[k], or npos: a
+    // terminator, maybe closing quotes or brackets, then whitespace; or a
+    // CJK full stop, exclamation or question mark
+    static size_t sentenceEnd(std::string_view text, size_t k) {
+        if (text[k] == '\xE3' || text[k] == '\xEF') {
+            std::string_view mark = text.substr(k, 3);
+            return (mark == "。" || mark == "！" || mark == "？") ? k + 3 : std::string_view::npos;
+        }
+        size_t i = k + 1;
+        while (i < text.size() && (text[i] == '"' || text[i] == '\'' || text[i] == ')' || text[i] == ']')) i++;
+        if (i < text.size() && (isBlank(text[i]) || text[i] == '\n')) return i + 1;
+        return std::string_view::npos;
+    }
+    
+    // True if text[i] is a newline that ends a blank line, looking back
+    static bool endsParagraph(std::string_view text, size_t i) {
+        while (i > 0 && isBlank(text[i - 1])) i--;
+        return i > 0 && text[i - 1] == '\n';
+    }
+    
+public:
+    // Offset just past the last break of the boundary mode in text, or npos
+    static size_t last(std::string_view text, BoundaryMode mode) {
+        const char* data = text.data();
+        switch (mode) {
+            case BoundaryMode::Paragraph:
+                for (size_t end = text.size(); end > 0; ) {
+                    auto newline = static_cast<const char*>(memrchr(data, '\n', end));
+                    if (!newline) break;
+                    size_t i = newline - data;
+                    if (endsParagraph(text, i)) return i + 1;
+                    end = i;
+                }
+                return last(text, BoundaryMode::Line);
+            case BoundaryMode::Sentence:
+                for (size_t k = text.size(); k-- > 0; ) {
+                    if (!mayEndSentence(data[k])) continue;
+                    size_t end = sentenceEnd(text, k);
+                    if (end != std::string_view::npos) return end;
+                }
+                return last(text, BoundaryMode::Line);
+            case BoundaryMode::Line: {
+                auto newline = static_cast<const char*>(memrchr(data, '\n', text.size()));
+                return newline ? newline - data + 1 : std::string_view::npos;
+            }
+            default:
+                return std::string_view::npos;
+        }
+    }
+    
+    // Offset just past the first break of the boundary mode in text, or npos
+    static size_t first(std::string_view text, BoundaryMode mode) {
+        const char* data = text.data();
+        switch (mode) {
+            case BoundaryMode::Paragraph:
+                for (size_t i = 0; i < text.size(); i++) {
+                    auto newline = static_cast<const char*>(memchr(data + i, '\n', text.size() - i));
+                    if (!newline) break;
+                    i = newline - data;
+                    if (endsParagraph(text, i)) return i + 1;
+                }
+                return first(text, BoundaryMode::Line);
+            case BoundaryMode::Sentence:
+                for (size_t k = 0; k < text.size(); k++) {
+                    if (!mayEndSentence(data[k])) continue;
+                    size_t end = sentenceEnd(text, k);
+                    if (end != std::string_view::npos) return end;
+                }
+                return first(text, BoundaryMode::Line);
+            case BoundaryMode::Line: {
+                auto newline = static_cast<const char*>(memchr(data, '\n', text.size()));
+                return newline ? newline - data + 1 : std::string_view::npos;
+            }
+            default:
+                return std::string_view::npos;
+        }
+    }
+};
+
+// Where the chunks of a text start, counted in bytes, codepoints or tokens
+// and optionally moved to a break (--boundary). Chunks are laid out from the
+// start of the text, or from its end in tail mode. Frontends derive from it
+// and give it the text through textLength() and readRange().
+class ChunkLayout {
+protected:
+    size_t chunk_size;        // In bytes, or in codepoints or tokens
+    bool count_codepoints;    // --codepoints
+    std::unique_ptr<Tokenizer> tokenizer; // Set to count tokens (--tokens)
+    size_t token_window;      // Bytes the last token chunk laid out backwards took
+    BoundaryMode boundary_mode; // --boundary
+    size_t boundary_slack;    // Percent of a chunk searched for a break (--slack)
+    bool tail_mode;
+    int total_chunks;
+    // Start offset of each chunk; a chunk ends where the next one starts.
+    // Boundaries are laid out once (aligned to the end in tail mode) and
+    // appends only extend the table, so chunk numbers stay stable.
+    std::vector<size_t> chunk_starts;
+    
+    ChunkLayout(bool tail, size_t size) :
+        chunk_size(size), count_codepoints(false), token_window(0), boundary_mode(BoundaryMode::Fixed),
+        boundary_slack(20), tail_mode(tail), total_chunks(0) {}
+    virtual ~ChunkLayout() = default;
+    
+    virtual size_t textLength() const = 0;
+    // A view that stays valid until the next call
+    virtual std::string_view readRange(size_t start, size_t length) = 0;
+    
+    // Moves a boundary to the start of the UTF-8 character it falls in, so
+    // no character is split between chunks: back if the chunk starting at
+    // floor keeps at least one byte, otherwise forward past the character.
+    // Text that is not UTF-8 there is left as it is.
+    size_t snapBoundary(size_t pos, size_t floor) {
+        size_t length = textLength();
+        size_t back = std::min<size_t>(3, pos - floor - 1);
+        size_t ahead = std::min<size_t>(3, length - pos - 1);
+        std::string_view bytes = readRange(pos - back, back + 1 + ahead);
+        
+        size_t i = back;
+        while (i > 0 && Utf8::isContinuation(bytes[i])) i--;
+        if (!Utf8::isContinuation(bytes[i])) return pos - back + i;
+        for (i = back + 1; i < bytes.size(); i++) {
+            if (!Utf8::isContinuation(bytes[i])) return pos - back + i;
+        }
+        return (pos + ahead + 1 == length) ? length : pos;
+    }
+    
+    // For tail layout, where the chunk ends at ceiling: moves a start
+    // boundary forward to the next character start, so the chunk shrinks
+    // instead of growing past chunk_size. Only when the character reaches
+    // ceiling does it go back, since the chunk would be empty otherwise.
+    size_t snapBoundaryForward(size_t pos, size_t ceiling) {
+        size_t ahead = std::min<size_t>(3, ceiling - pos - 1);
+        std::string_view bytes = readRange(pos, ahead + 1);
+        for (size_t i = 0; i < bytes.size(); i++) {
+            if (!Utf8::isContinuation(bytes[i])) return pos + i;
+        }
+        return (ahead == 3) ? pos : snapBoundary(pos, 0);
+    }
+    
+    // Bytes at the end (or start) of a chunk of the given length that are
+    // searched for a break
+    size_t slackBytes(size_t chunk_bytes) const {
+        return std::max<size_t>(1, chunk_bytes * boundary_slack / 100);
+    }
+    
+    // Bytes of the longest part of piece, from its start or from its end,
+    // that has at most count tokens and does not cut a character; 0 if none
+    // has. The whole piece must have more. The part is found by doubling a
+    // guess and then bisecting, so a long piece is tokenized O(log n) times.
+    size_t fitTokens(std::string_view piece, size_t count, bool from_end) {
+        auto part = [&](size_t n) {
+            return from_end ? piece.substr(piece.size() - n) : piece.substr(0, n);
+        };
+        auto whole = [&](size_t n) {
+            return n == 0 || n == piece.size() ||
+                   !Utf8::isContinuation(from_end ? piece[piece.size() - n] : piece[n]);
+        };
+        size_t good = 0;
+        size_t bad = piece.size();
+        for (size_t n = 16; n < bad; n *= 2) {
+            size_t m = n;
+            while (m > good && !whole(m)) m--;
+            if (m == good) continue;
+            if (tokenizer->countPiece(part(m)) > count) {
+                bad = m;
+                break;
+            }
+            good = m;
+        }
+        while (bad - good > 1) {
+            size_t mid = good + (bad - good) / 2;
+            size_t m = mid;
+            while (m > good && !whole(m)) m--;
+            if (m == good) {
+                for (m = mid + 1; m < bad && !whole(m); m++) {}
+                if (m == bad) break;
+            }
+            if (tokenizer->countPiece(part(m)) > count) {
+                bad = m;
+            } else {
+                good = m;
+            }
+        }
+        return good;
+    }
+    
+    // Offset after the most whole tokenizer pieces from start that together
+    // have at most count tokens. A piece with more than count tokens on its
+    // own, like a run of CJK text, which is one piece up to its next space,
+    // is cut between characters instead; a chunk has at least one character.
+    // The total goes to counted; a count of SIZE_MAX counts the rest of the text.
+    size_t skipTokens(size_t start, size_t count, size_t* counted = nullptr) {
+        size_t length = textLength();
+        size_t pos = start;
+        size_t total = 0;
+        while (pos < length) {
+            std::string_view block = readRange(pos, std::min<size_t>(1 << 20, length - pos));
+            bool last_block = (pos + block.size() == length);
+            size_t i = 0;
+            while (i < block.size()) {
+                size_t size = Tokenizer::pieceLength(block.substr(i));
+                if (i + size == block.size() && !last_block && i > 0) break; // may go on in the next block
+                std::string_view piece = block.substr(i, size);
+                size_t tokens = tokenizer->countPiece(piece);
+                if (total >= count || tokens > count - total) {
+                    size_t fit = (tokens > count && total < count) ? fitTokens(piece, count - total, false) : 0;
+                    if (fit == 0 && pos + i == start) fit = Utf8::skipCodepoints(piece.data(), size, 1);
+                    if (counted) *counted = total + (fit ? tokenizer->countPiece(piece.substr(0, fit)) : 0);
+                    return pos + i + fit;
+                }
+                total += tokens;
+                i += size;
+            }
+            pos += i;
+        }
+        if (counted) *counted = total;
+        return length;
+    }
+    
+    // Where the chunk starting at start ends, which may be past the text
+    size_t nextBoundary(size_t start) {
+        size_t length = textLength();
+        size_t end;
+        if (tokenizer) {
+            end = skipTokens(start, chunk_size);
+        } else if (count_codepoints) {
+            // chunk_size codepoints take at most 4 bytes each
+            size_t span = (chunk_size > (length - start) / 4) ? length - start : chunk_size * 4;
+            std::string_view text = readRange(start, span);
+            end = start + Utf8::skipCodepoints(text.data(), text.size(), chunk_size);
+        } else {
+            end = start + chunk_size;
+            if (end < length) end = snapBoundary(end, start);
+        }
+        if (end >= length || boundary_mode == BoundaryMode::Fixed) return end;
+        
+        size_t slack = slackBytes(end - start);
+        size_t cut = Breaks::last(readRange(end - slack, slack), boundary_mode);
+        return (cut == std::string_view::npos) ? end : end - slack + cut;
+    }
+    
+    // Start of the most whole pieces before end that have at most chunk_size
+    // tokens, where a piece with more is cut as in skipTokens. Pieces only
+    // depend on the text after their start, so pieces found from the start
+    // of a window before end are the chunk's own; the window grows until the
+    // pieces after its first, possibly cut one, hold chunk_size tokens. It
+    // starts a little larger than the previous chunk, so most chunks are
+    // tokenized about once.
+    size_t previousTokenBoundary(size_t end) {
+        std::vector<std::pair<size_t, size_t>> pieces; // Offset in the window, tokens
+        size_t guess = token_window ? token_window + token_window / 8 + 64 : chunk_size * 8;
+        size_t span = std::min(guess, end);
+        std::string_view text;
+        while (true) {
+            text = readRange(end - span, span);
+            pieces.clear();
+            size_t after_first = 0;
+            for (size_t i = 0; i < text.size(); ) {
+                size_t size = Tokenizer::pieceLength(text.substr(i));
+                size_t tokens = tokenizer->countPiece(text.substr(i, size));
+                if (i > 0) after_first += tokens;
+                pieces.emplace_back(i, tokens);
+                i += size;
+            }
+            if (after_first >= chunk_size || span == end) break;
+            span = (span > end / 2) ? end : span * 2;
+        }
+        
+        size_t total = 0;
+        size_t k = pieces.size();
+        while (k > 0 && pieces[k - 1].second <= chunk_size - total) {
+            total += pieces[--k].second;
+        }
+        size_t taken = (k == 0) ? 0 : (k < pieces.size()) ? pieces[k].first : span;
+        size_t start = end - span + taken;
+        if (k > 0 && (pieces[k - 1].second > chunk_size || k == pieces.size())) {
+            std::string_view piece = text.substr(pieces[k - 1].first, taken - pieces[k - 1].first);
+            size_t fit = (pieces[k - 1].second > chunk_size) ? fitTokens(piece, chunk_size - total, true) : 0;
+            if (fit == 0 && k == pieces.size()) {
+                for (fit = 1; fit < piece.size() && Utf8::isContinuation(piece[piece.size() - fit]); fit++) {}
+            }
+            start -= fit;
+        }
+        token_window = end - start;
+        return start;
+    }
+    
+    // Where the chunk ending at end starts, for laying out tail mode from the
+    // end of the text; 0 if the chunk reaches the start
+    size_t previousBoundary(size_t end) {
+        size_t start;
+        if (tokenizer) {
+            start = previousTokenBoundary(end);
+        } else if (count_codepoints) {
+            size_t span = (chunk_size > end / 4) ? end : chunk_size * 4;
+            std::string_view text = readRange(end - span, span);
+            size_t leads = Utf8::countCodepoints(text.data(), text.size());
+            start = end - span;
+            if (leads >= chunk_size) {
+                start += Utf8::skipCodepoints(text.data(), text.size(), leads - chunk_size);
+            }
+        } else {
+            start = (end > chunk_size) ? snapBoundaryForward(end - chunk_size, end) : 0;
+        }
+        if (start == 0 || start >= end || boundary_mode == BoundaryMode::Fixed) return start;
+        
+        size_t slack = slackBytes(end - start);
+        size_t cut = Breaks::first(readRange(start, slack), boundary_mode);
+        return (cut != std::string_view::npos && start + cut < end) ? start + cut : start;
+    }
+    
+    // Lays out all chunk boundaries for the current text and chunk size. In
+    // tail mode the short chunk goes first, so the others end at the end:
+    // the chunks are laid out backwards from there.
+    void layOutChunks() {
+        size_t length = textLength();
+        chunk_starts.assign(1, 0);
+        token_window = 0;
+        
+        if (tail_mode) {
+            for (size_t end = length; end > 0; ) {
+                size_t start = previousBoundary(end);
+                if (start == 0 || start >= end) break; // only the first chunk is left
+                chunk_starts.push_back(start);
+                end = start;
+            }
+            std::reverse(chunk_starts.begin() + 1, chunk_starts.end());
+        } else {
+            if (!count_codepoints && !tokenizer && boundary_mode == BoundaryMode::Fixed) {
+                chunk_starts.reserve(1 + length / chunk_size);
+            }
+            for (size_t start = nextBoundary(0); start < length; start = nextBoundary(start)) {
+                chunk_starts.push_back(start);
+            }
+        }
+        total_chunks = chunk_starts.size();
+    }
+    
+    // After an append: grows the last chunk up to chunk_size and adds chunks
+    // for the rest, in O(appended bytes); earlier chunks are untouched.
+    // Returns true if the old last chunk took some of the appended text.
+    bool extendChunks(size_t old_length) {
+        size_t length = textLength();
+        size_t end = nextBoundary(chunk_starts.back());
+        bool last_grew = (length > old_length && end != old_length);
+        
+        for (; end < length; end = nextBoundary(end)) {
+            chunk_starts.push_back(end);
+        }
+        total_chunks = chunk_starts.size();
+        return last_grew;
+    }
+    
+    size_t countCodepointsFrom(size_t start, size_t end) {
+        size_t count = 0;
+        for (; start < end; start += 1 << 20) {
+            std::string_view block = readRange(start, std::min<size_t>(1 << 20, end - start));
+            count += Utf8::countCodepoints(block.data(), block.size());
+        }
+        return count;
+    }
+    
+    // The last chunk that has reached chunk_size, or 0 if there is none
+    int findNewestCompleteChunk() {
+        int pos = total_chunks;
+        if (pos == 0) return 0;
+        
+        size_t start = chunk_starts[pos - 1];
+        size_t length = textLength();
+        size_t size;
+        if (tokenizer) {
+            skipTokens(start, SIZE_MAX, &size);
+        } else if (count_codepoints) {
+            size = countCodepointsFrom(start, length);
+        } else {
+            size = length - start;
+        }
+        return (size >= chunk_size) ? pos : pos - 1;
+    }
+    
+    // Returns a view of the chunk at pos (from 1), invalidated like readRange
+    std::string_view getChunkAtPosition(int pos) {
+        if (pos < 1 || pos > total_chunks) {
+            return "";
+        }
+        
+        size_t start_pos = chunk_starts[pos - 1];
+        size_t end_pos = (pos < total_chunks) ? chunk_starts[pos] : textLength();
+        
+        return readRange(start_pos, end_pos - start_pos);
+    }
+    
+public:
+    void setCountCodepoints(bool enabled) { count_codepoints = enabled; }
+    // Counts chunk_size in tokens, with BPE merges if a vocabulary is given
+    void setCountTokens(bool enabled, std::shared_ptr<const TokenRanks> vocabulary) {
+        tokenizer = enabled ? std::make_unique<Tokenizer>(std::move(vocabulary)) : nullptr;
+    }
+    void setBoundaryMode(BoundaryMode mode, size_t slack_percent) {
+        boundary_mode = mode;
+        boundary_slack = slack_percent;
+    }
+};
+
+// The file behind --follow: an inotify watch on it, and how much of it the
+// text already holds
+class FollowedFile {
+private:
+    int fd;
+    int inotify_fd;
+    size_t offset;            // Bytes of the file that are in the text
+    std::string file_path;
+    
+public:
+    // Refreshed: reader holds the new bytes; Appended: they went to append
+    enum class Change { Unchanged, Refreshed, Appended, Truncated };
+    
+    FollowedFile() : fd(-1), inotify_fd(-1), offset(0) {}
+    FollowedFile(const FollowedFile&) = delete;
+    FollowedFile& operator=(const FollowedFile&) = delete;
+    
+    ~FollowedFile() {
+        if (inotify_fd >= 0) ::close(inotify_fd);
+        if (fd >= 0) ::close(fd);
+    }
+    
+    // Watches path, of which the first length bytes are in the text;
+    // on_change runs from input whenever the file is written
+    bool open(const std::string& path, size_t length, CommandInput& input, std::function<void()> on_change) {
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0 || inotify_fd < 0 ||
+            inotify_add_watch(inotify_fd, path.c_str(), IN_MODIFY | IN_CLOSE_WRITE) < 0) {
+            return false;
+        }
+        input.watch(inotify_fd, std::move(on_change));
+        file_path = path;
+        offset = length;
+        return true;
+    }
+    
+    const std::string& path() const { return file_path; }
+    
+    // After a truncation the text was reloaded with length bytes of the file
+    void restart(size_t length) { offset = length; }
+    
+    // Drains the watch and brings the text up to date with the file. New
+    // bytes are already in reader if it reads the file itself; otherwise
+    // (text was added with 'A' after the file) they are passed to append.
+    // A truncated file is left to the caller to reload.
+    Change update(StreamReader& reader, const std::function<bool(std::string_view)>& append) {
+        char events[4096];
+        while (::read(inotify_fd, events, sizeof(events)) > 0) {
+            // Drain; the file size tells us everything we need
+        }
+        
+        struct stat st;
+        if (fstat(fd, &st) != 0) return Change::Unchanged;
+        size_t size = st.st_size;
+        if (size < offset) return Change::Truncated;
+        if (size == offset) return Change::Unchanged;
+        
+        size_t old_length = reader.size();
+        if (reader.refresh()) {
+            offset += reader.size() - old_length;
+            return Change::Refreshed;
+        }
+        std::vector<char> buffer(1 << 20);
+        while (offset < size) {
+            ssize_t n = pread(fd, buffer.data(), std::min(buffer.size(), size - offset), offset);
+            if (n <= 0 || !append(std::string_view(buffer.data(), n))) break;
+            offset += n;
+        }
+        return Change::Appended;
+    }
+};
@@ -6,95 +6,221 @@
 #include <cstdlib>
 #include <sstream>
 #include <ctime>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <climits>
+#include <string_view>
+#include <deque>
+#include <array>
+#include <cctype>
+#include <memory>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <functional>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "chunking.h"
 
 #include <QApplication>
 #include <QClipboard>
-#include <future>
+#include <QMetaObject>
 #include <chrono>
 
 using str = std::string;
 
+// QClipboard may only be used on the GUI thread, which runs the Qt event
+// loop while the command loop runs on a thread of its own. Reads return the
+// last text seen through dataChanged, so they never wait on a clipboard
+// owner that is slow to answer; writes are queued to the GUI thread.
 class ClipboardManager {
 private:
     QClipboard* clipboard;
+    std::mutex cache_mutex;
+    std::string cached_text;
 
 public:
-    ClipboardManager(QClipboard* cb) : clipboard(cb) {}
-
-    std::string getClipboard(int timeout_ms = 800) {
-        // Run QClipboard::text() in a separate thread
-        auto fut = std::async(std::launch::async, [this]() {
-            return clipboard->text().toStdString();
+    // Must be constructed on the GUI thread
+    ClipboardManager(QClipboard* cb) : clipboard(cb), cached_text(cb->text().toStdString()) {
+        QObject::connect(clipboard, &QClipboard::dataChanged, clipboard, [this]() {
+            std::string text = clipboard->text().toStdString();
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            cached_text.swap(text);
         });
+    }
 
-        if (fut.wait_for(std::chrono::milliseconds(timeout_ms)) == std::future_status::ready) {
-            return fut.get();
-        } else {
-            std::cerr << "⚠ Clipboard read timed out (Chrome/Electron app locked it)" << std::endl;
-            return ""; // gracefully fail instead of freezing
-        }
+    std::string getClipboard() {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        return cached_text;
     }
 
-    bool setClipboard(const std::string& text) {
-        clipboard->setText(QString::fromStdString(text));
+    bool setClipboard(std::string_view text) {
+        QString qtext = QString::fromUtf8(text.data(), text.size());
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            cached_text.assign(text);
+        }
+        QMetaObject::invokeMethod(clipboard, [this, qtext]() { clipboard->setText(qtext); },
+                                  Qt::QueuedConnection);
         return true;
     }
 };
 
-class TextChunker {
+class TextChunker : public ChunkLayout {
 private:
     str text;
-    size_t chunk_size;
-    bool tail_mode;
+    MappedFile mapped_file;
+    StreamReader stream_reader; // used instead of both in --stream mode
+    bool stream_mode;
     bool inverted;
     int current_chunk;
-    int total_chunks;
     std::string temp_file_path;
+    SnapshotWriter snapshot;
+    CommandInput input;
+    // --follow: new bytes of the file are picked up as they are written
+    bool follow_mode = false;
+    bool follow_copy = false; // --follow-copy: also copy each new complete chunk
+    FollowedFile followed;
+    int newest_complete_chunk = 0;
     ClipboardManager& clipboard;
 
-    void recalculateChunks() {
-        total_chunks = (text.length() + chunk_size - 1) / chunk_size;
-        if (total_chunks == 0) total_chunks = 1;
+    std::string_view content() const {
+        return mapped_file.isOpen() ? mapped_file.view() : std::string_view(text);
+    }
 
-        if (current_chunk > total_chunks) current_chunk = total_chunks;
-        if (current_chunk < 1) current_chunk = 1;
+    size_t textLength() const override {
+        return stream_reader.isOpen() ? stream_reader.size() : content().length();
+    }
 
-        updateTempFile();
+    std::string_view readRange(size_t start, size_t length) override {
+        if (stream_reader.isOpen()) return stream_reader.read(start, length);
+        return content().substr(start, length);
     }
 
-    void updateTempFile() {
+    const std::string& tempFilePath() {
         if (temp_file_path.empty()) {
             time_t now = time(nullptr);
             temp_file_path = "/tmp/textchunker_" + std::to_string(now) + ".txt";
         }
+        return temp_file_path;
+    }
 
-        std::ofstream temp_file(temp_file_path);
-        if (temp_file.is_open()) {
-            temp_file << text;
-            temp_file.close();
+    void recalculateChunks() {
+        layOutChunks();
+        if (current_chunk > total_chunks) current_chunk = total_chunks;
+        if (current_chunk < 1) current_chunk = 1;
+    }
+
+    // Append-only /tmp snapshot, written off-thread and started on first use.
+    // Unmodified files are already on disk; streamed input lives in the temp file.
+    SnapshotWriter& journal() {
+        if (!snapshot.isOpen()) {
+            snapshot.open(tempFilePath());
             std::cout << "Text saved to: " << temp_file_path << std::endl;
         }
+        return snapshot;
+    }
+
+    bool appendData(std::string_view data) {
+        size_t old_length = textLength();
+        if (stream_reader.isOpen()) {
+            if (!stream_reader.append(data, tempFilePath())) {
+                std::cerr << "Error: Could not write to " << temp_file_path << std::endl;
+                return false;
+            }
+        } else {
+            snapshot.wait(); // the journal writes from text, so let it finish first
+            if (mapped_file.isOpen()) {
+                journal().appendFile(dup(mapped_file.descriptor()), mapped_file.view().size());
+                text.assign(mapped_file.view());
+                mapped_file.close();
+            }
+            text.append(data);
+            journal().appendBorrowed(std::string_view(text).substr(old_length));
+        }
+        extendChunks(old_length);
+        return true;
     }
 
-    std::string getChunkAtPosition(int pos) {
-        if (pos < 1 || pos > total_chunks) return "";
+    bool startFollowing(const std::string& filename) {
+        if (!followed.open(filename, textLength(), input, [this]() { onFileChanged(); })) {
+            std::cerr << "Error: Could not watch " << filename << std::endl;
+            return false;
+        }
+        newest_complete_chunk = findNewestCompleteChunk();
+        std::cout << "Following " << filename << " for appended text" << std::endl;
+        return true;
+    }
 
-        size_t start_pos, end_pos;
-        if (tail_mode ^ inverted) {
-            end_pos = text.length() - (total_chunks - pos) * chunk_size;
-            start_pos = (end_pos > chunk_size) ? end_pos - chunk_size : 0;
+    void onFileChanged() {
+        size_t old_length = textLength();
+        int old_chunks = total_chunks;
+        auto append = [this](std::string_view data) { return appendData(data); };
+        switch (followed.update(stream_reader, append)) {
+            case FollowedFile::Change::Unchanged: return;
+            case FollowedFile::Change::Truncated: reloadFollowedFile(); return;
+            case FollowedFile::Change::Refreshed: extendChunks(old_length); break;
+            case FollowedFile::Change::Appended: break;
+        }
+        size_t grown = textLength() - old_length;
+
+        std::cout << std::endl;
+        int newest = findNewestCompleteChunk();
+        if (follow_copy && newest > newest_complete_chunk) {
+            current_chunk = newest;
+            clipboard.setClipboard(getCurrentChunk());
+            std::cout << "✓ New chunk " << current_chunk << " copied to clipboard" << std::endl;
+            showStatus();
         } else {
-            start_pos = (pos - 1) * chunk_size;
-            end_pos = std::min(start_pos + chunk_size, text.length());
+            std::cout << "↻ Text grew by " << grown << " bytes (" << (total_chunks - old_chunks) << " new chunks)" << std::endl;
+        }
+        newest_complete_chunk = std::max(newest_complete_chunk, newest);
+        printPrompt();
+    }
+
+    // Truncation lost the old text, and mapping new bytes under the old
+    // length would repeat it, so the text restarts from the file's content
+    void reloadFollowedFile() {
+        std::cout << std::endl;
+        if (!stream_reader.open(followed.path())) {
+            std::cerr << "Error: Could not reopen " << followed.path() << std::endl;
+            printPrompt();
+            return;
         }
-        return text.substr(start_pos, end_pos - start_pos);
+        recalculateChunks();
+        if (tail_mode) current_chunk = total_chunks;
+        followed.restart(textLength());
+        newest_complete_chunk = findNewestCompleteChunk();
+        std::cout << "⚠ Followed file was truncated; reloaded it (" << textLength() << " bytes)" << std::endl;
+        printPrompt();
     }
 
+    void printPrompt() { std::cout << "Command: " << std::flush; }
+
 public:
-    TextChunker(bool tail, size_t size, ClipboardManager& cb)
-        : chunk_size(size), tail_mode(tail), inverted(false), current_chunk(1), clipboard(cb) {}
+    TextChunker(bool tail, size_t size, ClipboardManager& cb, bool stream = false)
+        : ChunkLayout(tail, size), stream_mode(stream), inverted(false), current_chunk(1), clipboard(cb) {}
+
+    // Follow mode reads through pread like --stream; a mapping of a file that
+    // gets truncated would fault
+    void setFollow(bool enabled, bool copy_new_chunks) {
+        follow_mode = enabled || copy_new_chunks;
+        follow_copy = copy_new_chunks;
+        if (follow_mode) stream_mode = true;
+    }
 
     ~TextChunker() {
+        snapshot.close(); // let pending journal writes finish
         if (!temp_file_path.empty()) {
             std::cout << "Temp file preserved at: " << temp_file_path << std::endl;
         }
@@ -107,29 +233,48 @@ public:
                 std::cerr << "Error: Clipboard is empty" << std::endl;
                 return false;
             }
-        } else {
-            std::ifstream file(filename);
+        } else if (stream_mode) {
+            bool from_stdin = (filename == "-");
+            bool opened = from_stdin ? stream_reader.spool(STDIN_FILENO, tempFilePath())
+                                     : stream_reader.open(filename);
+            if (!opened) {
+                std::cerr << "Error: Could not stream " << (from_stdin ? "stdin" : filename) << std::endl;
+                return false;
+            }
+            if (from_stdin) std::cout << "Input spooled to: " << temp_file_path << std::endl;
+        } else if (filename == "-" || !mapped_file.open(filename)) {
+            std::ifstream file(filename == "-" ? "/dev/stdin" : filename, std::ios::binary);
             if (!file) {
                 std::cerr << "Error: Could not open file " << filename << std::endl;
                 return false;
             }
-            text.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            std::vector<char> buffer(1 << 20);
+            while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0)
+                text.append(buffer.data(), file.gcount());
         }
 
-        if (text.empty()) {
+        if (filename == "-" && !reattachTerminal())
+            std::cerr << "Warning: No terminal to read commands from" << std::endl;
+
+        if (textLength() == 0) {
             std::cerr << "Error: No text loaded" << std::endl;
             return false;
         }
 
+        if (count_codepoints && !stream_reader.isOpen() && !Utf8::isValid(content().data(), content().size()))
+            std::cerr << "Warning: Input is not valid UTF-8; codepoint counts are approximate" << std::endl;
+
+        if (!mapped_file.isOpen() && !stream_reader.isOpen()) journal().appendBorrowed(text);
+
         recalculateChunks();
         if (tail_mode) current_chunk = total_chunks;
-        return true;
+        return !follow_mode || startFollowing(filename);
     }
 
-    std::string getCurrentChunk() { return getChunkAtPosition(current_chunk); }
+    std::string_view getCurrentChunk() { return getChunkAtPosition(current_chunk); }
 
     void copyToClipboard() {
-        std::string chunk = getCurrentChunk();
+        std::string_view chunk = getCurrentChunk();
         if (!chunk.empty()) {
             clipboard.setClipboard(chunk);
             std::cout << "✓ Chunk copied to clipboard" << std::endl;
@@ -138,8 +283,8 @@ public:
 
     void showStatus() {
         std::cout << "Chunk " << current_chunk << "/" << total_chunks
-                  << " (" << text.length() << " bytes total, "
-                  << chunk_size << " char chunks, "
+                  << " (" << textLength() << " bytes total, "
+                  << chunk_size << (tokenizer ? " token" : count_codepoints ? " char" : " byte") << " chunks, "
                   << (tail_mode ? "tail" : "head")
                   << (inverted ? ", inverted" : ")") << std::endl;
     }
@@ -153,18 +298,15 @@ public:
         } else if (cmd == "A" || cmd == "a") {
             std::cout << "Enter additional text (end with Ctrl+D or empty line):" << std::endl;
             std::string line, additional_text;
-            while (std::getline(std::cin, line)) {
+            while (input.readLine(line)) {
                 if (line.empty()) break;
                 additional_text += line + "\n";
             }
-            if (!additional_text.empty()) {
-                text += additional_text;
-                recalculateChunks();
+            if (!additional_text.empty() && appendData(additional_text))
                 std::cout << "Added " << additional_text.length() << " characters." << std::endl;
-            }
         } else if (cmd == "R" || cmd == "r") {
             // Force recopy
-            std::string chunk = getCurrentChunk();
+            std::string_view chunk = getCurrentChunk();
             clipboard.setClipboard(chunk);
             std::cout << "✓ Chunk recopied to clipboard" << std::endl;
         } else if (cmd == "P" || cmd == "p") {
@@ -186,7 +328,7 @@ public:
             current_chunk = total_chunks - current_chunk + 1;
         } else if (cmd[0] == '$' && cmd.length() > 1 && std::all_of(cmd.begin() + 1, cmd.end(), ::isdigit)) {
             size_t new_size = std::stoul(cmd.substr(1));
-            if (new_size > 0 && new_size <= text.length()) {
+            if (new_size > 0 && new_size <= textLength()) {
                 std::cout << "Changing chunk size from " << chunk_size << " to " << new_size << std::endl;
                 chunk_size = new_size;
                 recalculateChunks();
@@ -211,15 +353,15 @@ public:
     }
 
     void run() {
-        std::string input;
+        std::string line;
         while (true) {
             copyToClipboard();
             showStatus();
-            QCoreApplication::processEvents();
 
-            std::cout << "Command: ";
-            std::getline(std::cin, input);
-            if (!processCommand(input)) break;
+            printPrompt();
+            bool got_line = input.readLine(line);
+            if (!got_line && follow_mode) break;
+            if (!processCommand(line)) break;
         }
     }
 };
@@ -233,21 +375,79 @@ int main(int argc, char* argv[]) {
 
     std::cout << "Qt Text Chunker with Clipboard" << std::endl;
 
-    if (argc > 1) tail_mode = (std::string(argv[1]) == "1");
-    if (argc > 2) {
-        chunk_size = std::stoul(argv[2]);
+    // --options may appear anywhere; the rest are positional
+    bool stream_mode = false, follow = false, follow_copy = false, count_codepoints = false, count_tokens = false;
+    std::string vocabulary_path;
+    BoundaryMode boundary = BoundaryMode::Fixed;
+    size_t slack = 20;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--stream") stream_mode = true;
+        else if (arg == "--codepoints") count_codepoints = true; // chunk_size counts characters, not bytes
+        else if (arg == "--tokens") count_tokens = true; // chunk_size counts estimated tokens
+        else if (arg.compare(0, 8, "--vocab=") == 0) { // ...or BPE tokens of a tiktoken vocabulary
+            count_tokens = true;
+            vocabulary_path = arg.substr(8);
+        }
+        else if (arg == "--boundary=line") boundary = BoundaryMode::Line; // end chunks at a break
+        else if (arg == "--boundary=paragraph") boundary = BoundaryMode::Paragraph;
+        else if (arg == "--boundary=sentence") boundary = BoundaryMode::Sentence;
+        else if (arg.compare(0, 8, "--slack=") == 0) {  // percent of a chunk searched for it
+            if (!parseNumber(arg.substr(8), 3, slack) || slack == 0 || slack > 100) {
+                std::cerr << "Error: --slack needs a percentage from 1 to 100" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--follow") follow = true;       // chunk text appended to the file
+        else if (arg == "--follow-copy") follow_copy = true; // ...and copy each new full chunk
+        else args.push_back(arg);
+    }
+
+    if (args.size() > 0) tail_mode = (args[0] == "1");
+    if (args.size() > 1) {
+        chunk_size = std::stoul(args[1]);
         if (chunk_size == 0) {
             std::cerr << "Error: Chunk size must be > 0" << std::endl;
             return 1;
         }
     }
-    if (argc > 3) filename = argv[3];
-
-    ClipboardManager cb(QApplication::clipboard());
-    TextChunker chunker(tail_mode, chunk_size, cb);
+    if (args.size() > 2) filename = args[2]; // - reads stdin
+    if (stream_mode && filename.empty()) {
+        std::cerr << "Error: --stream needs a filename (or - for stdin)" << std::endl;
+        return 1;
+    }
+    if ((follow || follow_copy) && (filename.empty() || filename == "-")) {
+        std::cerr << "Error: --follow needs a file to watch" << std::endl;
+        return 1;
+    }
 
-    if (!chunker.loadText(filename)) return 1;
+    if (count_tokens && count_codepoints) {
+        std::cerr << "Error: --tokens and --codepoints can't be combined" << std::endl;
+        return 1;
+    }
+    std::shared_ptr<const TokenRanks> vocabulary;
+    if (!vocabulary_path.empty() && !(vocabulary = Tokenizer::loadVocabulary(vocabulary_path))) {
+        std::cerr << "Error: Could not read a vocabulary from " << vocabulary_path << std::endl;
+        return 1;
+    }
 
-    chunker.run();
-    return 0;
+    ClipboardManager cb(QApplication::clipboard());
+    TextChunker chunker(tail_mode, chunk_size, cb, stream_mode);
+    chunker.setFollow(follow, follow_copy);
+    chunker.setCountCodepoints(count_codepoints);
+    chunker.setCountTokens(count_tokens, vocabulary);
+    chunker.setBoundaryMode(boundary, slack);
+
+    // The command loop blocks on stdin, so it gets its own thread and the
+    // main thread runs the event loop the clipboard depends on
+    int status = 0;
+    std::thread session([&]() {
+        if (chunker.loadText(filename)) chunker.run();
+        else status = 1;
+        QMetaObject::invokeMethod(&app, []() { QCoreApplication::quit(); }, Qt::QueuedConnection);
+    });
+    app.exec();
+    session.join();
+    return status;
 }
@@ -5,10 +5,40 @@
 #include <algorithm>
 #include <cstdlib>
 #include <limits>
-#include <set>
+#include <cstdint>
+#include <functional>
 #include <sstream>
 #include <ctime>
+#include <string_view>
+#include <cerrno>
+#include <cstdio>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <iomanip>
+#include <array>
+#include <cctype>
+#include <unordered_map>
 #include <unistd.h>
+#include <fcntl.h>
+#include <csignal>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "chunking.h"
 
 #ifdef __linux__
 // X11 includes
@@ -16,42 +46,539 @@
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
 
-// Wayland includes (if available)
+// Wayland includes (if available). Building with -DWAYLAND_SUPPORT also needs
+// -lwayland-client plus the client header and glue code that wayland-scanner
+// generates from wlr-protocols' wlr-data-control-unstable-v1.xml.
 #ifdef WAYLAND_SUPPORT
+#include <cstring>
 #include <wayland-client.h>
+#include "wlr-data-control-unstable-v1-client-protocol.h"
 #endif
 #endif
 
 using str = std::string;
 
-class ClipboardManager {
+#ifdef __linux__
+// Owns the CLIPBOARD selection on an X connection and thread of its own, so
+// pastes in other applications are answered right away, whatever the
+// interactive loop is doing. New text is published with an atomic pointer
+// swap; transfers in flight keep the text they started with.
+class SelectionServer {
 private:
     Display* display;
     Window window;
     Atom clipboard_atom;
     Atom utf8_atom;
     Atom targets_atom;
-    bool x11_available;
+    Atom incr_atom;
+    Atom text_atom;
+    size_t max_property_bytes; // Largest property one request can carry
+    
+    std::shared_ptr<const std::string> text; // Only through std::atomic_load/store
+    std::atomic<bool> owning;
+    std::atomic<bool> stopping;
+    int wake_fd;
+    std::thread thread;
+    
+    // Claiming the selection must happen on the server's connection, since
+    // the X server sends requests to the client that claimed it
+    std::mutex claim_mutex;
+    std::condition_variable claim_done;
+    uint64_t claims_requested;
+    uint64_t claims_completed;
+    
+    // An INCR transfer in progress: the next piece of data is sent to the
+    // requestor each time it deletes the property
+    struct Transfer {
+        Window requestor;
+        Atom property;
+        Atom type;
+        std::shared_ptr<const std::string> data;
+        size_t offset;
+        std::chrono::steady_clock::time_point last_activity;
+    };
+    std::vector<Transfer> transfers; // Server thread only
     
 public:
-    ClipboardManager() : display(nullptr), window(0), x11_available(false) {
-        #ifdef __linux__
-        // Try to initialize X11
-        display = XOpenDisplay(nullptr);
+    SelectionServer() : display(nullptr), window(0), max_property_bytes(0), owning(false),
+        stopping(false), wake_fd(-1), claims_requested(0), claims_completed(0) {}
+    
+    ~SelectionServer() {
+        if (thread.joinable()) {
+            stopping = true;
+            wake();
+            thread.join();
+        }
+        if (wake_fd >= 0) ::close(wake_fd);
         if (display) {
-            int screen = DefaultScreen(display);
-            window = XCreateSimpleWindow(display, RootWindow(display, screen),
-                                       0, 0, 1, 1, 0, 0, 0);
+            if (window) XDestroyWindow(display, window);
+            XCloseDisplay(display);
+        }
+    }
+    
+    bool start() {
+        display = XOpenDisplay(nullptr);
+        wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (!display || wake_fd < 0) return false;
+        
+        window = XCreateSimpleWindow(display, DefaultRootWindow(display), 0, 0, 1, 1, 0, 0, 0);
+        clipboard_atom = XInternAtom(display, "CLIPBOARD", False);
+        utf8_atom = XInternAtom(display, "UTF8_STRING", False);
+        targets_atom = XInternAtom(display, "TARGETS", False);
+        incr_atom = XInternAtom(display, "INCR", False);
+        text_atom = XInternAtom(display, "TEXT", False);
+        
+        // Request sizes are in 4-byte units; leave room for the request header
+        long max_request = XExtendedMaxRequestSize(display);
+        if (max_request == 0) max_request = XMaxRequestSize(display);
+        max_property_bytes = std::min<size_t>(max_request * 4 - 1024, 4 << 20);
+        XFlush(display);
+        
+        thread = std::thread(&SelectionServer::run, this);
+        return true;
+    }
+    
+    Window owner() const { return window; }
+    
+    std::shared_ptr<const std::string> current() const { return std::atomic_load(&text); }
+    
+    // Makes text the clipboard content. Only when another client took the
+    // selection in the meantime does this wait for the server to reclaim it.
+    bool publish(std::string_view new_text) {
+        std::atomic_store(&text, std::make_shared<const std::string>(new_text));
+        if (owning) return true;
+        
+        std::unique_lock<std::mutex> lock(claim_mutex);
+        uint64_t ticket = ++claims_requested;
+        wake();
+        claim_done.wait_for(lock, std::chrono::seconds(1),
+                            [&]() { return claims_completed >= ticket; });
+        return owning;
+    }
+    
+private:
+    void wake() {
+        uint64_t one = 1;
+        ssize_t written = ::write(wake_fd, &one, sizeof(one));
+        (void)written; // A full counter still wakes the thread
+    }
+    
+    void run() {
+        struct pollfd fds[2] = {{ConnectionNumber(display), POLLIN, 0}, {wake_fd, POLLIN, 0}};
+        while (!stopping) {
+            // Idle transfers are checked once a second
+            poll(fds, 2, transfers.empty() ? -1 : 1000);
+            if (fds[1].revents & POLLIN) {
+                uint64_t count;
+                ssize_t got = ::read(wake_fd, &count, sizeof(count));
+                (void)got;
+            }
             
-            clipboard_atom = XInternAtom(display, "CLIPBOARD", False);
-            utf8_atom = XInternAtom(display, "UTF8_STRING", False);
-            targets_atom = XInternAtom(display, "TARGETS", False);
+            claimIfRequested();
+            
+            while (XPending(display)) {
+                XEvent event;
+                XNextEvent(display, &event);
+                if (event.type == SelectionRequest) {
+                    serveSelectionRequest(event.xselectionrequest);
+                } else if (event.type == PropertyNotify && event.xproperty.state == PropertyDelete) {
+                    continueTransfer(event.xproperty);
+                } else if (event.type == SelectionClear) {
+                    owning = false;
+                }
+            }
             
-            x11_available = true;
+            // Drop transfers whose requestor stopped asking for more
+            auto now = std::chrono::steady_clock::now();
+            transfers.erase(std::remove_if(transfers.begin(), transfers.end(),
+                [&](const Transfer& transfer) {
+                    if (now - transfer.last_activity < std::chrono::seconds(5)) return false;
+                    XSelectInput(display, transfer.requestor, NoEventMask);
+                    return true;
+                }), transfers.end());
+            XFlush(display);
         }
-        #endif
     }
     
+    void claimIfRequested() {
+        std::lock_guard<std::mutex> lock(claim_mutex);
+        if (claims_completed == claims_requested) return;
+        
+        XSetSelectionOwner(display, clipboard_atom, window, CurrentTime);
+        owning = (XGetSelectionOwner(display, clipboard_atom) == window);
+        claims_completed = claims_requested;
+        claim_done.notify_all();
+    }
+    
+    void serveSelectionRequest(const XSelectionRequestEvent& request) {
+        XSelectionEvent reply = {};
+        reply.type = SelectionNotify;
+        reply.display = request.display;
+        reply.requestor = request.requestor;
+        reply.selection = request.selection;
+        reply.target = request.target;
+        reply.time = request.time;
+        
+        // Obsolete clients pass no property and expect the target to be used
+        Atom property = (request.property != None) ? request.property : request.target;
+        reply.property = property;
+        
+        if (request.selection != clipboard_atom || request.owner != window) {
+            reply.property = None;
+        } else if (request.target == targets_atom) {
+            Atom targets[] = {targets_atom, utf8_atom, XA_STRING, text_atom};
+            XChangeProperty(display, request.requestor, property, XA_ATOM, 32, PropModeReplace,
+                            reinterpret_cast<unsigned char*>(targets), 4);
+        } else if (request.target == utf8_atom || request.target == XA_STRING ||
+                   request.target == text_atom) {
+            Atom type = (request.target == XA_STRING) ? XA_STRING : utf8_atom;
+            std::shared_ptr<const std::string> text = current();
+            if (!text) text = std::make_shared<const std::string>();
+            if (text->size() <= max_property_bytes) {
+                XChangeProperty(display, request.requestor, property, type, 8, PropModeReplace,
+                                reinterpret_cast<const unsigned char*>(text->data()),
+                                text->size());
+            } else {
+                // Too large for one request: announce INCR with the total
+                // size, then send a piece each time the requestor deletes
+                // the property
+                long size = text->size();
+                XSelectInput(display, request.requestor, PropertyChangeMask);
+                XChangeProperty(display, request.requestor, property, incr_atom, 32, PropModeReplace,
+                                reinterpret_cast<unsigned char*>(&size), 1);
+                transfers.push_back({request.requestor, property, type, text, 0,
+                                     std::chrono::steady_clock::now()});
+            }
+        } else {
+            reply.property = None;
+        }
+        
+        XSendEvent(display, request.requestor, False, NoEventMask, reinterpret_cast<XEvent*>(&reply));
+    }
+    
+    void continueTransfer(const XPropertyEvent& event) {
+        for (auto it = transfers.begin(); it != transfers.end(); ++it) {
+            if (it->requestor != event.window || it->property != event.atom) continue;
+            
+            // The last, empty piece tells the requestor the transfer is done
+            size_t length = std::min(max_property_bytes, it->data->size() - it->offset);
+            XChangeProperty(display, it->requestor, it->property, it->type, 8, PropModeReplace,
+                            reinterpret_cast<const unsigned char*>(it->data->data() + it->offset),
+                            length);
+            it->offset += length;
+            it->last_activity = std::chrono::steady_clock::now();
+            
+            if (length == 0) {
+                XSelectInput(display, it->requestor, NoEventMask);
+                transfers.erase(it);
+            }
+            return;
+        }
+    }
+    
+};
+#endif
+
+#if defined(__linux__) && defined(WAYLAND_SUPPORT)
+// Clipboard on Wayland through the wlr data-control protocol, which lets a
+// client without a focused surface own and read the selection. A thread of
+// its own keeps the connection and serves pastes from memory, so switching
+// chunks costs a pointer swap instead of starting wl-copy. All protocol
+// calls happen on that thread; the interactive thread hands it work through
+// an eventfd.
+class WaylandClipboard {
+private:
+    wl_display* display;
+    wl_registry* registry;
+    wl_seat* seat;
+    zwlr_data_control_manager_v1* manager;
+    zwlr_data_control_device_v1* device;
+    zwlr_data_control_source_v1* source;     // Ours, while we own the selection
+    zwlr_data_control_offer_v1* selection;   // The current selection, if any
+    
+    std::shared_ptr<const std::string> text; // Only through std::atomic_load/store
+    std::atomic<bool> owning;
+    std::atomic<bool> stopping;
+    int wake_fd;
+    std::thread thread;
+    
+    // Work for the protocol thread, guarded by requests_mutex
+    std::mutex requests_mutex;
+    bool publish_requested;
+    std::vector<int> receive_requests; // Pipe ends to send the selection to
+    
+    static constexpr const char* text_types[] = {
+        "text/plain;charset=utf-8", "UTF8_STRING", "text/plain", "STRING", "TEXT"
+    };
+    
+public:
+    WaylandClipboard() : display(nullptr), registry(nullptr), seat(nullptr), manager(nullptr),
+        device(nullptr), source(nullptr), selection(nullptr), owning(false), stopping(false),
+        wake_fd(-1), publish_requested(false) {}
+    
+    ~WaylandClipboard() {
+        if (thread.joinable()) {
+            stopping = true;
+            wake();
+            thread.join();
+        }
+        for (int fd : receive_requests) ::close(fd);
+        if (wake_fd >= 0) ::close(wake_fd);
+        if (!display) return;
+        
+        if (selection) destroyOffer(selection);
+        if (source) zwlr_data_control_source_v1_destroy(source);
+        if (device) zwlr_data_control_device_v1_destroy(device);
+        if (manager) zwlr_data_control_manager_v1_destroy(manager);
+        if (seat) wl_seat_destroy(seat);
+        if (registry) wl_registry_destroy(registry);
+        wl_display_disconnect(display);
+    }
+    
+    // Connects and starts the protocol thread; false if there is no Wayland
+    // compositor or it does not offer data-control
+    bool start() {
+        display = wl_display_connect(nullptr);
+        if (!display) return false;
+        
+        static const wl_registry_listener registry_listener = {onGlobal, onGlobalRemove};
+        registry = wl_display_get_registry(display);
+        wl_registry_add_listener(registry, &registry_listener, this);
+        wl_display_roundtrip(display);
+        if (!manager || !seat) return false;
+        
+        static const zwlr_data_control_device_v1_listener device_listener = {
+            onDataOffer, onSelection, onFinished, onPrimarySelection
+        };
+        device = zwlr_data_control_manager_v1_get_data_device(manager, seat);
+        zwlr_data_control_device_v1_add_listener(device, &device_listener, this);
+        wl_display_roundtrip(display); // Learn the current selection
+        
+        wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (wake_fd < 0) return false;
+        thread = std::thread(&WaylandClipboard::run, this);
+        return true;
+    }
+    
+    void publish(std::string_view new_text) {
+        std::atomic_store(&text, std::make_shared<const std::string>(new_text));
+        if (owning) return; // Our source serves the new text from now on
+        
+        std::lock_guard<std::mutex> lock(requests_mutex);
+        publish_requested = true;
+        wake();
+    }
+    
+    std::string read() {
+        if (owning) {
+            std::shared_ptr<const std::string> current = std::atomic_load(&text);
+            return current ? *current : "";
+        }
+        
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) != 0) return "";
+        {
+            std::lock_guard<std::mutex> lock(requests_mutex);
+            receive_requests.push_back(fds[1]);
+            wake();
+        }
+        
+        // The owner writes straight into the pipe and closes it when done;
+        // with no selection the protocol thread just closes our end. Like the
+        // X11 path, give up on an owner that sends nothing for a second.
+        std::string result;
+        size_t length = 0;
+        struct pollfd pipe_poll = {fds[0], POLLIN, 0};
+        while (true) {
+            int ready = poll(&pipe_poll, 1, 1000);
+            if (ready < 0 && errno == EINTR) continue;
+            if (ready <= 0) {
+                length = 0;
+                break;
+            }
+            result.resize(length + (1 << 16));
+            ssize_t n = ::read(fds[0], &result[length], result.size() - length);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            length += n;
+        }
+        result.resize(length);
+        ::close(fds[0]);
+        return result;
+    }
+    
+private:
+    void wake() {
+        uint64_t one = 1;
+        ssize_t written = ::write(wake_fd, &one, sizeof(one));
+        (void)written; // A full counter still wakes the thread
+    }
+    
+    void run() {
+        struct pollfd fds[2] = {{wl_display_get_fd(display), POLLIN, 0}, {wake_fd, POLLIN, 0}};
+        while (!stopping) {
+            while (wl_display_prepare_read(display) != 0) {
+                wl_display_dispatch_pending(display);
+            }
+            wl_display_flush(display);
+            
+            if (poll(fds, 2, -1) < 0) {
+                wl_display_cancel_read(display);
+                continue;
+            }
+            if (fds[0].revents & POLLIN) {
+                wl_display_read_events(display);
+            } else {
+                wl_display_cancel_read(display);
+            }
+            wl_display_dispatch_pending(display);
+            
+            if (fds[1].revents & POLLIN) {
+                uint64_t count;
+                ssize_t got = ::read(wake_fd, &count, sizeof(count));
+                (void)got;
+                handleRequests();
+            }
+        }
+    }
+    
+    void handleRequests() {
+        std::lock_guard<std::mutex> lock(requests_mutex);
+        if (publish_requested) {
+            publish_requested = false;
+            static const zwlr_data_control_source_v1_listener source_listener = {onSend, onCancelled};
+            zwlr_data_control_source_v1* new_source = zwlr_data_control_manager_v1_create_data_source(manager);
+            for (const char* type : text_types) {
+                zwlr_data_control_source_v1_offer(new_source, type);
+            }
+            zwlr_data_control_source_v1_add_listener(new_source, &source_listener, this);
+            zwlr_data_control_device_v1_set_selection(device, new_source);
+            if (source) zwlr_data_control_source_v1_destroy(source);
+            source = new_source;
+            owning = true;
+        }
+        
+        for (int fd : receive_requests) {
+            const char* type = selection ? preferredType(selection) : nullptr;
+            if (type) zwlr_data_control_offer_v1_receive(selection, type, fd);
+            ::close(fd); // The owner got its own copy of the descriptor
+        }
+        receive_requests.clear();
+        wl_display_flush(display);
+    }
+    
+    // The best text type the offer lists, or nullptr if it has no text
+    static const char* preferredType(zwlr_data_control_offer_v1* offer) {
+        auto* types = static_cast<std::vector<std::string>*>(zwlr_data_control_offer_v1_get_user_data(offer));
+        for (const char* type : text_types) {
+            if (std::find(types->begin(), types->end(), type) != types->end()) return type;
+        }
+        return nullptr;
+    }
+    
+    static void destroyOffer(zwlr_data_control_offer_v1* offer) {
+        delete static_cast<std::vector<std::string>*>(zwlr_data_control_offer_v1_get_user_data(offer));
+        zwlr_data_control_offer_v1_destroy(offer);
+    }
+    
+    static void onGlobal(void* data, wl_registry* registry, uint32_t name,
+                         const char* interface, uint32_t version) {
+        auto* self = static_cast<WaylandClipboard*>(data);
+        if (std::strcmp(interface, wl_seat_interface.name) == 0 && !self->seat) {
+            self->seat = static_cast<wl_seat*>(wl_registry_bind(registry, name, &wl_seat_interface, 1));
+        } else if (std::strcmp(interface, zwlr_data_control_manager_v1_interface.name) == 0) {
+            self->manager = static_cast<zwlr_data_control_manager_v1*>(
+                wl_registry_bind(registry, name, &zwlr_data_control_manager_v1_interface,
+                                 std::min(version, 2u)));
+        }
+    }
+    
+    static void onGlobalRemove(void*, wl_registry*, uint32_t) {}
+    
+    // Offers announce their types right after being introduced, before the
+    // selection event that uses them
+    static void onDataOffer(void*, zwlr_data_control_device_v1*, zwlr_data_control_offer_v1* offer) {
+        static const zwlr_data_control_offer_v1_listener offer_listener = {onOfferType};
+        zwlr_data_control_offer_v1_add_listener(offer, &offer_listener, new std::vector<std::string>());
+    }
+    
+    static void onOfferType(void* data, zwlr_data_control_offer_v1*, const char* type) {
+        static_cast<std::vector<std::string>*>(data)->push_back(type);
+    }
+    
+    static void onSelection(void* data, zwlr_data_control_device_v1*, zwlr_data_control_offer_v1* offer) {
+        auto* self = static_cast<WaylandClipboard*>(data);
+        if (self->selection) destroyOffer(self->selection);
+        self->selection = offer;
+    }
+    
+    static void onPrimarySelection(void*, zwlr_data_control_device_v1*, zwlr_data_control_offer_v1* offer) {
+        if (offer) destroyOffer(offer); // Only the clipboard is used
+    }
+    
+    static void onFinished(void* data, zwlr_data_control_device_v1*) {
+        // The seat went away; reads and writes fall through to nothing
+        static_cast<WaylandClipboard*>(data)->owning = false;
+    }
+    
+    // A paste: write the text on a short-lived thread, so a slow reader
+    // never holds up the protocol thread
+    static void onSend(void* data, zwlr_data_control_source_v1*, const char*, int32_t fd) {
+        auto* self = static_cast<WaylandClipboard*>(data);
+        std::shared_ptr<const std::string> snapshot = std::atomic_load(&self->text);
+        std::thread([snapshot, fd]() {
+            // A reader that closes early must not kill us with SIGPIPE
+            sigset_t pipe_signal;
+            sigemptyset(&pipe_signal);
+            sigaddset(&pipe_signal, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &pipe_signal, nullptr);
+            
+            for (size_t done = 0; snapshot && done < snapshot->size(); ) {
+                ssize_t n = ::write(fd, snapshot->data() + done, snapshot->size() - done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                done += n;
+            }
+            ::close(fd);
+        }).detach();
+    }
+    
+    static void onCancelled(void* data, zwlr_data_control_source_v1* cancelled) {
+        auto* self = static_cast<WaylandClipboard*>(data);
+        if (cancelled == self->source) {
+            self->source = nullptr;
+            self->owning = false;
+        }
+        zwlr_data_control_source_v1_destroy(cancelled);
+    }
+};
+#endif
+
+class ClipboardManager {
+private:
+    Display* display;
+    Window window;
+    Atom clipboard_atom;
+    Atom utf8_atom;
+    Atom targets_atom;
+    Atom incr_atom;
+    Atom selection_property;
+    bool x11_available;
+    bool initialized; // Backends are set up on first use
+    #ifdef __linux__
+    SelectionServer server;
+    #ifdef WAYLAND_SUPPORT
+    WaylandClipboard wayland;
+    bool wayland_available = false;
+    #endif
+    #endif
+    
+    // Errors from requestors that go away mid-transfer must not abort us
+    static int ignoreXError(Display*, XErrorEvent*) { return 0; }
+    
+public:
+    ClipboardManager() : display(nullptr), window(0), x11_available(false), initialized(false) {}
+    
     ~ClipboardManager() {
         #ifdef __linux__
         if (display) {
@@ -62,7 +589,13 @@ public:
     }
     
     std::string getClipboard() {
+        if (!initialized) initialize();
         #ifdef __linux__
+        #ifdef WAYLAND_SUPPORT
+        if (wayland_available) {
+            return wayland.read();
+        }
+        #endif
         if (x11_available) {
             return getX11Clipboard();
         }
@@ -72,8 +605,15 @@ public:
         return getClipboardFallback();
     }
     
-    bool setClipboard(const std::string& text) {
+    bool setClipboard(std::string_view text) {
+        if (!initialized) initialize();
         #ifdef __linux__
+        #ifdef WAYLAND_SUPPORT
+        if (wayland_available) {
+            wayland.publish(text);
+            return true;
+        }
+        #endif
         if (x11_available) {
             return setX11Clipboard(text);
         }
@@ -82,134 +622,551 @@ public:
         // Fallback to external tools
         return setClipboardFallback(text);
     }
-
+    
 private:
+    // Connects to the display server; done lazily so runs that never touch
+    // the clipboard (--export) work without one
+    void initialize() {
+        initialized = true;
+        #ifdef __linux__
+        #ifdef WAYLAND_SUPPORT
+        // A native Wayland session needs no X connection at all
+        wayland_available = wayland.start();
+        if (wayland_available) return;
+        #endif
+        
+        // Try to initialize X11. The selection is served from a second
+        // connection on its own thread.
+        XInitThreads();
+        XSetErrorHandler(ignoreXError);
+        display = XOpenDisplay(nullptr);
+        if (display) {
+            int screen = DefaultScreen(display);
+            window = XCreateSimpleWindow(display, RootWindow(display, screen),
+                                       0, 0, 1, 1, 0, 0, 0);
+            
+            clipboard_atom = XInternAtom(display, "CLIPBOARD", False);
+            utf8_atom = XInternAtom(display, "UTF8_STRING", False);
+            targets_atom = XInternAtom(display, "TARGETS", False);
+            incr_atom = XInternAtom(display, "INCR", False);
+            selection_property = XInternAtom(display, "CLIPBOARD_CONTENT", False);
+            
+            x11_available = server.start();
+        }
+        #endif
+    }
+    
     #ifdef __linux__
+    // Sleeps on the X connection until an event of the given type arrives for
+    // our window, so a reply is handled as soon as the owner sends it.
+    // Returns false if none arrived before the timeout.
+    bool waitForEvent(int type, XEvent& event, std::chrono::milliseconds timeout) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        struct pollfd connection = {ConnectionNumber(display), POLLIN, 0};
+        
+        while (true) {
+            // Reads whatever the server already sent before checking the queue
+            if (XCheckTypedWindowEvent(display, window, type, &event)) {
+                return true;
+            }
+            
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            if (remaining.count() <= 0) {
+                return false;
+            }
+            
+            // Round up so we never wake just before the deadline and spin
+            if (poll(&connection, 1, static_cast<int>(remaining.count()) + 1) < 0 && errno != EINTR) {
+                return false;
+            }
+        }
+    }
+    
     std::string getX11Clipboard() {
         Window owner = XGetSelectionOwner(display, clipboard_atom);
         if (owner == None) return "";
+        if (owner == server.owner()) {
+            // Asking our own server would work, but this skips the round trips
+            std::shared_ptr<const std::string> text = server.current();
+            return text ? *text : "";
+        }
         
-        Atom selection_property = XInternAtom(display, "CLIPBOARD_CONTENT", False);
-        
-        // Request clipboard content
+        // Property changes are selected before the request: an INCR owner
+        // writes its first piece as soon as the INCR property is deleted,
+        // and selecting only then could miss that piece
+        XSelectInput(display, window, PropertyChangeMask);
         XConvertSelection(display, clipboard_atom, utf8_atom, selection_property, window, CurrentTime);
         XFlush(display);
         
         // Wait for SelectionNotify event
         XEvent event;
-        for (int i = 0; i < 100; i++) { // Timeout after ~1 second
-            if (XCheckTypedWindowEvent(display, window, SelectionNotify, &event)) {
-                break;
-            }
-            usleep(10000); // 10ms
+        std::string result;
+        if (waitForEvent(SelectionNotify, event, std::chrono::seconds(1)) &&
+            event.xselection.property != None && readProperty(result) == incr_atom) {
+            readIncremental(result);
         }
         
-        if (event.type != SelectionNotify) return "";
+        XSelectInput(display, window, NoEventMask);
+        while (XCheckTypedWindowEvent(display, window, PropertyNotify, &event)) {
+            // Discard notifications left over from the transfer
+        }
+        return result;
+    }
+    
+    // INCR: the owner sends the text in pieces, each one after we delete
+    // the previous piece; a zero-length piece ends the transfer. readProperty
+    // already deleted the INCR property, whose value (a lower bound on the
+    // total size) is passed in result.
+    void readIncremental(std::string& result) {
+        if (result.size() >= sizeof(long)) {
+            result.reserve(*reinterpret_cast<const long*>(result.data()));
+        }
+        result.clear();
         
-        if (event.xselection.property == None) return "";
+        // Notifications up to our deletion of the INCR property belong to the
+        // INCR property itself; the first piece can only come after it
+        XEvent event;
+        while (XCheckTypedWindowEvent(display, window, PropertyNotify, &event)) {
+            if (event.xproperty.atom == selection_property &&
+                event.xproperty.state == PropertyDelete) {
+                break;
+            }
+        }
         
-        // Get the data
-        Atom actual_type;
+        std::string piece;
+        while (waitForEvent(PropertyNotify, event, std::chrono::seconds(1))) {
+            if (event.xproperty.atom != selection_property ||
+                event.xproperty.state != PropertyNewValue) {
+                continue;
+            }
+            readProperty(piece);
+            if (piece.empty()) break;
+            result += piece;
+        }
+    }
+    
+    // Reads and deletes the whole selection property in one request, so large
+    // texts are not split into 64K pieces with a round trip each. Returns the
+    // property type.
+    Atom readProperty(std::string& value) {
+        Atom actual_type = None;
         int actual_format;
         unsigned long nitems, bytes_after;
         unsigned char* data = nullptr;
         
-        if (XGetWindowProperty(display, window, selection_property, 0, 65536, False,
-                             AnyPropertyType, &actual_type, &actual_format,
-                             &nitems, &bytes_after, &data) != Success) {
-            return "";
+        value.clear();
+        const long whole_property = 0x1fffffff; // In 4-byte units; the server clamps it
+        if (XGetWindowProperty(display, window, selection_property, 0, whole_property, True,
+                               AnyPropertyType, &actual_type, &actual_format,
+                               &nitems, &bytes_after, &data) != Success) {
+            return None;
         }
         
-        std::string result;
-        if (data && nitems > 0) {
-            result = std::string(reinterpret_cast<char*>(data), nitems);
+        if (data) {
+            // Format 32 items are stored as longs, whatever their size on the wire
+            size_t item_size = (actual_format == 32) ? sizeof(long) : actual_format / 8;
+            value.assign(reinterpret_cast<char*>(data), nitems * item_size);
             XFree(data);
         }
-        
-        return result;
+        return actual_type;
+    }
+    
+    bool setX11Clipboard(std::string_view text) {
+        // Publishing the text is a pointer swap; the server thread answers
+        // every paste from then on
+        return server.publish(text);
+    }
+    #endif
+    
+    // External clipboard tools, tried in order until one works. The one that
+    // worked is used first from then on, and tools that are not installed
+    // are never tried again.
+    struct ClipboardTool {
+        const char* const* paste_argv;
+        const char* const* copy_argv;
+        bool missing;
+    };
+    
+    static constexpr const char* wl_paste[] = {"wl-paste", nullptr};
+    static constexpr const char* wl_copy[] = {"wl-copy", nullptr};
+    static constexpr const char* xclip_paste[] = {"xclip", "-selection", "clipboard", "-o", nullptr};
+    static constexpr const char* xclip_copy[] = {"xclip", "-selection", "clipboard", "-i", nullptr};
+    static constexpr const char* xsel_paste[] = {"xsel", "--clipboard", "--output", nullptr};
+    static constexpr const char* xsel_copy[] = {"xsel", "--clipboard", "--input", nullptr};
+    
+    ClipboardTool tools[3] = {
+        {wl_paste, wl_copy, false},
+        {xclip_paste, xclip_copy, false},
+        {xsel_paste, xsel_copy, false}
+    };
+    int working_tool = 0;
+    
+    // Runs a tool directly (no shell), feeding it input if given and
+    // collecting its stdout if output is given. Returns true if it exited 0.
+    bool runTool(ClipboardTool& tool, const char* const* argv,
+                 const std::string_view* input, std::string* output) {
+        int in_pipe[2] = {-1, -1};
+        int out_pipe[2] = {-1, -1};
+        if ((input && pipe2(in_pipe, O_CLOEXEC) != 0) ||
+            (output && pipe2(out_pipe, O_CLOEXEC) != 0)) {
+            for (int fd : {in_pipe[0], in_pipe[1], out_pipe[0], out_pipe[1]}) {
+                if (fd >= 0) ::close(fd);
+            }
+            return false;
+        }
+        
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        if (input) posix_spawn_file_actions_adddup2(&actions, in_pipe[0], STDIN_FILENO);
+        if (output) posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+        
+        pid_t pid;
+        int error = posix_spawnp(&pid, argv[0], &actions, nullptr,
+                                 const_cast<char* const*>(argv), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        if (input) ::close(in_pipe[0]);
+        if (output) ::close(out_pipe[1]);
+        
+        if (error != 0) {
+            if (error == ENOENT) tool.missing = true;
+            if (input) ::close(in_pipe[1]);
+            if (output) ::close(out_pipe[0]);
+            return false;
+        }
+        
+        if (input) {
+            // A tool that exits early must not kill us with SIGPIPE
+            sigset_t pipe_signal, old_mask;
+            sigemptyset(&pipe_signal);
+            sigaddset(&pipe_signal, SIGPIPE);
+            pthread_sigmask(SIG_BLOCK, &pipe_signal, &old_mask);
+            
+            bool broken = false;
+            for (size_t done = 0; done < input->size(); ) {
+                ssize_t n = ::write(in_pipe[1], input->data() + done, input->size() - done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) {
+                    broken = (errno == EPIPE);
+                    break;
+                }
+                done += n;
+            }
+            ::close(in_pipe[1]);
+            
+            if (broken) {
+                struct timespec no_wait = {0, 0};
+                sigtimedwait(&pipe_signal, nullptr, &no_wait);
+            }
+            pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+        }
+        
+        if (output) {
+            output->clear();
+            size_t length = 0;
+            while (true) {
+                output->resize(length + (1 << 16));
+                ssize_t n = ::read(out_pipe[0], &(*output)[length], output->size() - length);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                length += n;
+            }
+            output->resize(length);
+            ::close(out_pipe[0]);
+        }
+        
+        int status = 0;
+        pid_t waited;
+        while ((waited = waitpid(pid, &status, 0)) < 0 && errno == EINTR) {}
+        if (waited != pid) return false; // no exit status, so count it as failing
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+    
+    // Runs the working tool, or the others in order until one succeeds
+    bool runFallback(const std::string_view* input, std::string* output) {
+        for (int attempt = -1; attempt < 3; attempt++) {
+            int index = (attempt < 0) ? working_tool : attempt;
+            if (attempt == working_tool) continue;
+            
+            ClipboardTool& tool = tools[index];
+            if (tool.missing) continue;
+            if (runTool(tool, input ? tool.copy_argv : tool.paste_argv, input, output) &&
+                (input || !output->empty())) {
+                working_tool = index;
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    std::string getClipboardFallback() {
+        std::string result;
+        if (!runFallback(nullptr, &result)) result.clear();
+        return result;
+    }
+    
+    bool setClipboardFallback(std::string_view text) {
+        return runFallback(&text, nullptr);
+    }
+};
+
+// Log2-bucketed histogram of command-to-prompt times (--latency)
+class LatencyHistogram {
+private:
+    static constexpr int kBuckets = 40;
+    uint64_t counts[kBuckets] = {}; // bucket b holds [2^(b-1), 2^b) us; 0 is < 1 us
+    uint64_t samples = 0;
+
+public:
+    void record(std::chrono::steady_clock::duration elapsed) {
+        uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        int bucket = us == 0 ? 0 : std::min(kBuckets - 1, 64 - __builtin_clzll(us));
+        counts[bucket]++;
+        samples++;
+    }
+
+    void print(std::ostream& out) const {
+        out << "Command-to-prompt latency (" << samples << " commands):" << std::endl;
+        uint64_t peak = *std::max_element(std::begin(counts), std::end(counts));
+        for (int b = 0; b < kBuckets; b++) {
+            if (counts[b] == 0) continue;
+            uint64_t low = b == 0 ? 0 : uint64_t(1) << (b - 1);
+            uint64_t high = uint64_t(1) << b;
+            out << std::setw(10) << low << " - " << std::setw(10) << high << " us: "
+                << std::setw(6) << counts[b] << " "
+                << std::string(counts[b] * 40 / peak, '#') << std::endl;
+        }
+    }
+};
+
+// Collects output as iovecs pointing into the chunk views and writes them
+// with writev(), so exported text is never copied in user space. Only
+// record headers and JSON escapes are built.
+class ChunkExporter {
+private:
+    int fd;
+    std::vector<struct iovec> iov;
+    std::deque<std::string> scratch; // Built pieces; a deque keeps them in place
+    bool failed;
+
+public:
+    explicit ChunkExporter(int out_fd) : fd(out_fd), failed(false) {}
+
+    // The piece must stay valid until the next flush()
+    void add(std::string_view piece) {
+        if (piece.empty()) return;
+        iov.push_back({const_cast<char*>(piece.data()), piece.size()});
+        if (iov.size() >= IOV_MAX) flush();
+    }
+
+    void addCopy(std::string piece) {
+        scratch.push_back(std::move(piece));
+        add(scratch.back());
+    }
+
+    // Adds text as the contents of a JSON string: runs that need no escaping
+    // go out straight from the view
+    void addJsonString(std::string_view text) {
+        static const std::vector<std::string> escapes = [] {
+            std::vector<std::string> table(256);
+            char code[8];
+            for (int c = 0; c < 0x20; c++) {
+                snprintf(code, sizeof(code), "\\u%04x", c);
+                table[c] = code;
+            }
+            table['\b'] = "\\b";
+            table['\f'] = "\\f";
+            table['\n'] = "\\n";
+            table['\r'] = "\\r";
+            table['\t'] = "\\t";
+            table['"'] = "\\\"";
+            table['\\'] = "\\\\";
+            return table;
+        }();
+
+        size_t run_start = 0;
+        for (size_t i = 0; i < text.size(); i++) {
+            const std::string& escape = escapes[static_cast<unsigned char>(text[i])];
+            if (escape.empty()) continue;
+            add(text.substr(run_start, i - run_start));
+            add(escape);
+            run_start = i + 1;
+        }
+        add(text.substr(run_start));
+    }
+
+    bool flush() {
+        if (!failed && !iov.empty()) {
+            failed = !writeAll(fd, iov.data(), iov.size());
+        }
+        iov.clear();
+        scratch.clear();
+        return !failed;
+    }
+};
+
+// Set of 64-bit chunk content hashes kept in an open-addressing table, so
+// remembering a used chunk costs a few bytes instead of a copy of its text.
+class ChunkFingerprints {
+private:
+    std::vector<uint64_t> slots; // 0 marks an empty slot
+    size_t count;
+
+    static uint64_t fingerprint(std::string_view chunk) {
+        uint64_t hash = std::hash<std::string_view>{}(chunk);
+        return hash ? hash : 1;
+    }
+
+    size_t findSlot(uint64_t hash) const {
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+        while (slots[i] != 0 && slots[i] != hash) {
+            i = (i + 1) & mask; // linear probing
+        }
+        return i;
     }
-    
-    bool setX11Clipboard(const std::string& text) {
-        // Store text for later retrieval
-        clipboard_text = text;
-        
-        // Claim clipboard ownership
-        XSetSelectionOwner(display, clipboard_atom, window, CurrentTime);
-        
-        if (XGetSelectionOwner(display, clipboard_atom) != window) {
-            return false;
+
+    void grow() {
+        std::vector<uint64_t> old;
+        old.swap(slots);
+        slots.assign(old.empty() ? 64 : old.size() * 2, 0);
+        for (uint64_t hash : old) {
+            if (hash) slots[findSlot(hash)] = hash;
         }
-        
-        // Handle selection requests
-        XFlush(display);
-        return true;
     }
-    
-    std::string clipboard_text; // Store clipboard content
-    #endif
-    
-    std::string getClipboardFallback() {
-        // Try different clipboard tools
-        const char* commands[] = {
-            "wl-paste 2>/dev/null",
-            "xclip -selection clipboard -o 2>/dev/null",
-            "xsel --clipboard --output 2>/dev/null"
-        };
-        
-        for (const char* cmd : commands) {
-            FILE* pipe = popen(cmd, "r");
-            if (pipe) {
-                std::string result;
-                char buffer[4096];
-                while (fgets(buffer, sizeof(buffer), pipe)) {
-                    result += buffer;
-                }
-                int status = pclose(pipe);
-                if (status == 0 && !result.empty()) {
-                    return result;
-                }
-            }
+
+public:
+    ChunkFingerprints() : count(0) {}
+
+    bool contains(std::string_view chunk) const {
+        if (slots.empty()) return false;
+        return slots[findSlot(fingerprint(chunk))] != 0;
+    }
+
+    void insert(std::string_view chunk) {
+        if ((count + 1) * 2 > slots.size()) grow(); // keep load factor <= 0.5
+        uint64_t hash = fingerprint(chunk);
+        size_t i = findSlot(hash);
+        if (slots[i] == 0) {
+            slots[i] = hash;
+            count++;
         }
-        return "";
     }
-    
-    bool setClipboardFallback(const std::string& text) {
-        // Try different clipboard tools
-        const char* commands[] = {
-            "wl-copy 2>/dev/null",
-            "xclip -selection clipboard -i 2>/dev/null",
-            "xsel --clipboard --input 2>/dev/null"
-        };
-        
-        for (const char* cmd : commands) {
-            FILE* pipe = popen(cmd, "w");
-            if (pipe) {
-                fwrite(text.c_str(), 1, text.size(), pipe);
-                int status = pclose(pipe);
-                if (status == 0) {
-                    return true;
-                }
-            }
+
+    size_t size() const { return count; }
+
+    void clear() {
+        slots.clear();
+        count = 0;
+    }
+};
+
+// One bit per chunk position. Searches for the next clear bit skip 64
+// positions per step, so finding an unused chunk stays cheap even when
+// almost all of millions of chunks are used.
+class ChunkBitmap {
+private:
+    std::vector<uint64_t> words;
+    size_t bits;
+
+public:
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+    ChunkBitmap() : bits(0) {}
+
+    void reset(size_t count) {
+        bits = count;
+        words.assign((count + 63) / 64, 0);
+    }
+
+    // Adds clear bits at the end, keeping the existing ones
+    void grow(size_t count) {
+        if (count <= bits) return;
+        bits = count;
+        words.resize((count + 63) / 64, 0);
+    }
+
+    bool test(size_t i) const { return (words[i / 64] >> (i % 64)) & 1; }
+    void set(size_t i) { words[i / 64] |= uint64_t(1) << (i % 64); }
+    void clear(size_t i) { words[i / 64] &= ~(uint64_t(1) << (i % 64)); }
+
+    // First clear bit at or after i, or npos
+    size_t findNextClear(size_t i) const {
+        if (i >= bits) return npos;
+        size_t w = i / 64;
+        uint64_t free_bits = ~words[w] & (~uint64_t(0) << (i % 64));
+        while (free_bits == 0) {
+            if (++w == words.size()) return npos;
+            free_bits = ~words[w];
         }
-        return false;
+        size_t found = w * 64 + __builtin_ctzll(free_bits);
+        return found < bits ? found : npos;
+    }
+
+    // Last clear bit at or before i, or npos
+    size_t findPrevClear(size_t i) const {
+        if (i >= bits) return npos;
+        size_t w = i / 64;
+        uint64_t free_bits = ~words[w] & (~uint64_t(0) >> (63 - i % 64));
+        while (free_bits == 0) {
+            if (w-- == 0) return npos;
+            free_bits = ~words[w];
+        }
+        return w * 64 + 63 - __builtin_clzll(free_bits);
     }
 };
 
-class TextChunker {
+class TextChunker : public ChunkLayout {
 private:
-    str text;
-    size_t chunk_size;
-    bool tail_mode;
+    str text; // Owned text (clipboard input, or a mapped file once modified)
+    MappedFile mapped_file;
+    StreamReader stream_reader; // Used instead of both in --stream mode
+    bool stream_mode;
     bool inverted;
     int current_chunk;
-    int total_chunks;
-    std::set<std::string> used_chunks; // Track used chunks
+    ChunkFingerprints used_chunks; // Content hashes of used chunks
+    ChunkBitmap used_positions;    // Positions known to hold used content
     std::string temp_file_path;
+    SnapshotWriter snapshot;
+    bool sync_journal;        // Journal on the interactive thread (--sync-journal)
+    bool headless;            // No journal and no terminal (--export)
+    bool report_latency;      // Print a latency histogram on exit (--latency)
+    LatencyHistogram latency;
+    CommandInput input;
+    // Follow mode (--follow): new bytes of the input file are picked up as
+    // they are written
+    bool follow_mode;
+    bool follow_copy;         // Also copy each new complete chunk (--follow-copy)
+    FollowedFile followed;
+    int newest_complete_chunk;
     ClipboardManager clipboard;
     
+    // The text being chunked: the file mapping if one is open, else the owned copy
+    std::string_view content() const {
+        return mapped_file.isOpen() ? mapped_file.view() : std::string_view(text);
+    }
+    
+    size_t textLength() const override {
+        return stream_reader.isOpen() ? stream_reader.size() : content().length();
+    }
+    
+    std::string_view readRange(size_t start, size_t length) override {
+        if (stream_reader.isOpen()) return stream_reader.read(start, length);
+        return content().substr(start, length);
+    }
+    
+    const std::string& tempFilePath() {
+        if (temp_file_path.empty()) {
+            time_t now = time(nullptr);
+            temp_file_path = "/tmp/textchunker_" + std::to_string(now) + ".txt";
+        }
+        return temp_file_path;
+    }
+
+    // Lays out the chunks again, e.g. for a new chunk size
     void recalculateChunks() {
-        total_chunks = (text.length() + chunk_size - 1) / chunk_size;
-        if (total_chunks == 0) total_chunks = 1;
+        layOutChunks();
         
         if (current_chunk > total_chunks) {
             current_chunk = total_chunks;
@@ -218,82 +1175,83 @@ private:
             current_chunk = 1;
         }
         
-        // Update temp file
-        updateTempFile();
+        // Positions moved; the bitmap is refilled lazily from used_chunks
+        used_positions.reset(total_chunks);
     }
     
-    void updateTempFile() {
-        if (temp_file_path.empty()) {
-            // Create temp file path
-            time_t now = time(nullptr);
-            temp_file_path = "/tmp/textchunker_" + std::to_string(now) + ".txt";
+    // After an append: earlier chunks keep their used state, but the short
+    // last chunk changed if it grew
+    void growChunks(size_t old_length) {
+        size_t last = chunk_starts.size() - 1;
+        if (extendChunks(old_length)) {
+            used_positions.clear(last);
         }
-        
-        std::ofstream temp_file(temp_file_path);
-        if (temp_file.is_open()) {
-            temp_file << text;
-            temp_file.close();
+        used_positions.grow(total_chunks);
+    }
+    
+    // The /tmp snapshot journal, started on first use. Unmodified mapped files
+    // are already on disk, and streamed input lives in the temp file itself,
+    // so neither is journaled.
+    SnapshotWriter& journal() {
+        if (!snapshot.isOpen()) {
+            snapshot.open(tempFilePath(), !sync_journal);
             std::cout << "Text saved to: " << temp_file_path << std::endl;
         }
+        return snapshot;
     }
     
-    bool isChunkUsed(const std::string& chunk) {
-        return used_chunks.find(chunk) != used_chunks.end();
+    // A position is used if its bit is set or its content matches a used
+    // chunk; positions found through the content check are cached in the bitmap
+    bool isChunkUsed(int pos) {
+        size_t index = pos - 1;
+        if (used_positions.test(index)) return true;
+        if (!used_chunks.contains(getChunkAtPosition(pos))) return false;
+        used_positions.set(index);
+        return true;
     }
     
-    void markChunkAsUsed(const std::string& chunk) {
-        used_chunks.insert(chunk);
+    void markChunkAsUsed(int pos) {
+        used_chunks.insert(getChunkAtPosition(pos));
+        used_positions.set(pos - 1);
     }
     
-    int findNextUnusedChunk() {
-        int start_chunk = current_chunk;
-        
-        do {
-            std::string chunk = getChunkAtPosition(current_chunk);
-            if (!isChunkUsed(chunk)) {
-                return current_chunk;
-            }
-            
-            // Move to next chunk
-            if (tail_mode ^ inverted) {
-                current_chunk = std::max(1, current_chunk - 1);
-            } else {
-                current_chunk = std::min(total_chunks, current_chunk + 1);
-            }
-            
-            // If we've wrapped around, break
-            if (current_chunk == start_chunk) {
-                break;
-            }
-            
-        } while (true);
-        
-        return -1; // No unused chunks found
+    // Nearest unused chunk from pos (inclusive) in the given direction, or -1.
+    // Each position fails the content check at most once before its bit is set.
+    int findUnusedChunkFrom(int pos, bool backward) {
+        size_t index = pos - 1;
+        while (true) {
+            index = backward ? used_positions.findPrevClear(index)
+                             : used_positions.findNextClear(index);
+            if (index == ChunkBitmap::npos) return -1;
+            if (!isChunkUsed(index + 1)) return index + 1;
+        }
     }
     
-    std::string getChunkAtPosition(int pos) {
-        if (pos < 1 || pos > total_chunks) {
-            return "";
-        }
-        
-        size_t start_pos, end_pos;
-        
-        if (tail_mode ^ inverted) {
-            end_pos = text.length() - (total_chunks - pos) * chunk_size;
-            start_pos = (end_pos > chunk_size) ? end_pos - chunk_size : 0;
-        } else {
-            start_pos = (pos - 1) * chunk_size;
-            end_pos = std::min(start_pos + chunk_size, text.length());
-        }
-        
-        return text.substr(start_pos, end_pos - start_pos);
+    int findNextUnusedChunk() {
+        return findUnusedChunkFrom(current_chunk, tail_mode ^ inverted);
     }
     
 public:
-    TextChunker(bool tail, size_t size) : 
-        chunk_size(size), tail_mode(tail), inverted(false), current_chunk(1) {}
+    TextChunker(bool tail, size_t size, bool stream = false) : 
+        ChunkLayout(tail, size), stream_mode(stream), inverted(false), current_chunk(1),
+        sync_journal(false), headless(false), report_latency(false), follow_mode(false), follow_copy(false),
+        newest_complete_chunk(0) {}
+    
+    void setSyncJournal(bool enabled) { sync_journal = enabled; }
+    void setHeadless(bool enabled) { headless = enabled; }
+    void setLatencyReport(bool enabled) { report_latency = enabled; }
+    
+    // Follow mode reads the file through pread, like --stream, since a
+    // mapping of a file that gets truncated would fault on access
+    void setFollow(bool enabled, bool copy_new_chunks) {
+        follow_mode = enabled || copy_new_chunks;
+        follow_copy = copy_new_chunks;
+        if (follow_mode) stream_mode = true;
+    }
     
     ~TextChunker() {
+        snapshot.close(); // let pending journal writes finish
+        
         // Optionally clean up temp file
         if (!temp_file_path.empty()) {
             std::cout << "Temp file preserved at: " << temp_file_path << std::endl;
@@ -307,25 +1265,148 @@ public:
                 std::cerr << "Error: Clipboard is empty or couldn't access clipboard" << std::endl;
                 return false;
             }
-        } else {
-            std::ifstream file(filename);
+        } else if (stream_mode) {
+            bool from_stdin = (filename == "-");
+            bool opened = from_stdin ? stream_reader.spool(STDIN_FILENO, tempFilePath())
+                                     : stream_reader.open(filename);
+            if (!opened) {
+                std::cerr << "Error: Could not stream " << (from_stdin ? "stdin" : filename) << std::endl;
+                return false;
+            }
+            if (from_stdin) {
+                std::cout << "Input spooled to: " << temp_file_path << std::endl;
+            }
+        } else if (filename == "-" || !mapped_file.open(filename)) {
+            // Not mappable (stdin, pipe, device, ...): read it in large blocks instead
+            std::ifstream file(filename == "-" ? "/dev/stdin" : filename, std::ios::binary);
             if (!file) {
                 std::cerr << "Error: Could not open file " << filename << std::endl;
                 return false;
             }
             
-            text.assign((std::istreambuf_iterator<char>(file)),
-                       std::istreambuf_iterator<char>());
+            std::vector<char> buffer(1 << 20);
+            while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0) {
+                text.append(buffer.data(), file.gcount());
+            }
+        }
+        
+        if (filename == "-" && !headless && !reattachTerminal()) {
+            std::cerr << "Warning: No terminal to read commands from" << std::endl;
         }
         
-        if (text.empty()) {
+        if (textLength() == 0) {
             std::cerr << "Error: No text loaded" << std::endl;
             return false;
         }
         
+        if (count_codepoints && !stream_reader.isOpen() &&
+            !Utf8::isValid(content().data(), content().size())) {
+            std::cerr << "Warning: Input is not valid UTF-8; codepoint counts are approximate" << std::endl;
+        }
+        
+        if (!mapped_file.isOpen() && !stream_reader.isOpen() && !headless) {
+            journal().appendBorrowed(text);
+        }
+        
         recalculateChunks();
         if (tail_mode) current_chunk = total_chunks;
         
+        if (follow_mode && !startFollowing(filename)) {
+            return false;
+        }
+        
+        return true;
+    }
+    
+    bool startFollowing(const std::string& filename) {
+        if (!followed.open(filename, textLength(), input, [this]() { onFileChanged(); })) {
+            std::cerr << "Error: Could not watch " << filename << std::endl;
+            return false;
+        }
+        newest_complete_chunk = findNewestCompleteChunk();
+        std::cout << "Following " << filename << " for appended text" << std::endl;
+        return true;
+    }
+    
+    // Called when the inotify watch fires: picks up whatever was appended to
+    // the followed file since the last time
+    void onFileChanged() {
+        size_t old_length = textLength();
+        size_t old_chunks = total_chunks;
+        auto append = [this](std::string_view data) { return appendData(data); };
+        switch (followed.update(stream_reader, append)) {
+            case FollowedFile::Change::Unchanged:
+                return;
+            case FollowedFile::Change::Truncated:
+                reloadFollowedFile();
+                return;
+            case FollowedFile::Change::Refreshed:
+                growChunks(old_length);
+                break;
+            case FollowedFile::Change::Appended:
+                break;
+        }
+        size_t grown = textLength() - old_length;
+        
+        std::cout << std::endl;
+        int newest = findNewestCompleteChunk();
+        if (follow_copy && newest > newest_complete_chunk) {
+            current_chunk = newest;
+            clipboard.setClipboard(getCurrentChunk());
+            markChunkAsUsed(current_chunk);
+            std::cout << "✓ New chunk " << current_chunk << " copied to clipboard" << std::endl;
+            showStatus();
+        } else {
+            std::cout << "↻ Text grew by " << grown << " bytes ("
+                      << (total_chunks - old_chunks) << " new chunks)" << std::endl;
+        }
+        newest_complete_chunk = std::max(newest_complete_chunk, newest);
+        printPrompt();
+    }
+    
+    // The text before a truncation is gone from the file, and its old length
+    // would make the reader map new bytes over it, so the text restarts from
+    // what the file holds now. Text added with 'A' is dropped with it.
+    void reloadFollowedFile() {
+        std::cout << std::endl;
+        if (!stream_reader.open(followed.path())) {
+            std::cerr << "Error: Could not reopen " << followed.path() << std::endl;
+            printPrompt();
+            return;
+        }
+        used_chunks.clear();
+        recalculateChunks();
+        if (tail_mode) current_chunk = total_chunks;
+        followed.restart(textLength());
+        newest_complete_chunk = findNewestCompleteChunk();
+        std::cout << "⚠ Followed file was truncated; reloaded it (" << textLength() << " bytes, "
+                  << total_chunks << " chunks)" << std::endl;
+        printPrompt();
+    }
+    
+    // Adds text at the end of the current text and extends the chunk table
+    bool appendData(std::string_view data) {
+        size_t old_length = textLength();
+        if (stream_reader.isOpen()) {
+            if (!stream_reader.append(data, tempFilePath())) {
+                std::cerr << "Error: Could not write to " << temp_file_path << std::endl;
+                return false;
+            }
+        } else {
+            // The journal writes from text itself, so it must be done with
+            // text before text changes
+            snapshot.wait();
+            if (mapped_file.isOpen()) {
+                // Take a private copy before modifying the text. The
+                // journal copies the file itself, inside the kernel.
+                journal().appendFile(dup(mapped_file.descriptor()), mapped_file.view().size());
+                text.assign(mapped_file.view());
+                mapped_file.close();
+            }
+            text.append(data);
+            journal().appendBorrowed(std::string_view(text).substr(old_length));
+        }
+        growChunks(old_length);
         return true;
     }
     
@@ -333,28 +1414,26 @@ public:
         std::cout << "Enter additional text (end with Ctrl+D or empty line):" << std::endl;
         std::string line, additional_text;
         
-        while (std::getline(std::cin, line)) {
+        while (input.readLine(line)) {
             if (line.empty()) break;
             additional_text += line + "\n";
         }
         
-        if (!additional_text.empty()) {
-            text += additional_text;
-            recalculateChunks();
+        if (!additional_text.empty() && appendData(additional_text)) {
             std::cout << "Added " << additional_text.length() << " characters." << std::endl;
         }
     }
     
-    std::string getCurrentChunk() {
+    std::string_view getCurrentChunk() {
         return getChunkAtPosition(current_chunk);
     }
     
     void copyToClipboard() {
-        std::string chunk = getCurrentChunk();
+        std::string_view chunk = getCurrentChunk();
         if (!chunk.empty()) {
-            if (!isChunkUsed(chunk)) {
+            if (!isChunkUsed(current_chunk)) {
                 clipboard.setClipboard(chunk);
-                markChunkAsUsed(chunk);
+                markChunkAsUsed(current_chunk);
                 std::cout << "✓ Chunk copied to clipboard" << std::endl;
             } else {
                 std::cout << "⚠ Chunk already used - finding next unused chunk..." << std::endl;
@@ -363,7 +1442,7 @@ public:
                     current_chunk = next_unused;
                     chunk = getCurrentChunk();
                     clipboard.setClipboard(chunk);
-                    markChunkAsUsed(chunk);
+                    markChunkAsUsed(current_chunk);
                     std::cout << "✓ Found unused chunk " << current_chunk << std::endl;
                 } else {
                     std::cout << "⚠ All chunks have been used" << std::endl;
@@ -375,8 +1454,8 @@ public:
     void showStatus() {
         int used_count = used_chunks.size();
         std::cout << "Chunk " << current_chunk << "/" << total_chunks 
-                  << " (" << text.length() << " bytes total, "
-                  << chunk_size << " char chunks, "
+                  << " (" << textLength() << " bytes total, "
+                  << chunk_size << (tokenizer ? " token" : count_codepoints ? " char" : " byte") << " chunks, "
                   << (tail_mode ? "tail" : "head") << " mode"
                   << (inverted ? ", inverted" : "") 
                   << ", " << used_count << " used)" << std::endl;
@@ -402,7 +1481,7 @@ public:
             return true;
         } else if (cmd == "R" || cmd == "r") {
             // Recopy current chunk (force copy even if used)
-            std::string chunk = getCurrentChunk();
+            std::string_view chunk = getCurrentChunk();
             if (!chunk.empty()) {
                 clipboard.setClipboard(chunk);
                 std::cout << "✓ Chunk recopied to clipboard" << std::endl;
@@ -415,6 +1494,7 @@ public:
         } else if (cmd == "reset") {
             // Reset used chunks
             used_chunks.clear();
+            used_positions.reset(total_chunks);
             std::cout << "Reset all chunks as unused" << std::endl;
             return true;
         } else if (cmd == "P" || cmd == "p") {
@@ -441,7 +1521,7 @@ public:
                    std::all_of(cmd.begin() + 1, cmd.end(), ::isdigit)) {
             // Change chunk size: $number
             size_t new_size = std::stoul(cmd.substr(1));
-            if (new_size > 0 && new_size <= text.length()) {
+            if (new_size > 0 && new_size <= textLength()) {
                 std::cout << "Changing chunk size from " << chunk_size 
                           << " to " << new_size << " characters" << std::endl;
                 chunk_size = new_size;
@@ -449,7 +1529,7 @@ public:
                 recalculateChunks();
             } else {
                 std::cout << "Invalid chunk size. Must be > 0 and <= text length (" 
-                          << text.length() << ")" << std::endl;
+                          << textLength() << ")" << std::endl;
                 return true;
             }
         } else if (cmd == "q" || cmd == "Q" || cmd == "quit") {
@@ -480,7 +1560,7 @@ public:
     }
     
     bool hasUnusedChunks() {
-        return used_chunks.size() < total_chunks;
+        return findUnusedChunkFrom(1, false) != -1;
     }
     
     bool isAtFinalChunk() {
@@ -491,16 +1571,118 @@ public:
         }
     }
     
+    // Limits first..last (last = 0 means through the end) to the chunks that
+    // exist; false if the range itself is malformed
+    bool clampRange(int& first, int& last) {
+        if (first < 1 || (last != 0 && first > last)) {
+            std::cerr << "Error: Invalid chunk range" << std::endl;
+            return false;
+        }
+        if (last == 0 || last > total_chunks) last = total_chunks;
+        return true;
+    }
+    
+    // Writes chunks first..last to fd as NUL-delimited text or JSON Lines,
+    // without touching the clipboard. JSON records name the file when a
+    // label is given. Returns the number of chunks written, or -1.
+    int exportStream(const std::string& format, int fd, int first, int last,
+                     const std::string& label = "") {
+        if (!clampRange(first, last)) return -1;
+        
+        // Stream windows only stay valid for a couple of chunks, so streamed
+        // chunks are written one at a time
+        bool views_stable = !stream_reader.isOpen();
+        ChunkExporter exporter(fd);
+        for (int pos = first; pos <= last; pos++) {
+            std::string_view chunk = getChunkAtPosition(pos);
+            if (format == "nul") {
+                exporter.add(chunk);
+                exporter.add(std::string_view("\0", 1));
+            } else {
+                if (!label.empty()) {
+                    exporter.add("{\"file\":\"");
+                    exporter.addJsonString(label);
+                    exporter.add("\",");
+                } else {
+                    exporter.add("{");
+                }
+                exporter.addCopy("\"chunk\":" + std::to_string(pos) +
+                                 ",\"offset\":" + std::to_string(chunk_starts[pos - 1]) +
+                                 ",\"text\":\"");
+                exporter.addJsonString(chunk);
+                exporter.add("\"}\n");
+            }
+            if (!views_stable && !exporter.flush()) break;
+        }
+        
+        if (!exporter.flush()) {
+            std::cerr << "Error: Could not write the exported chunks" << std::endl;
+            return -1;
+        }
+        return std::max(0, last - first + 1);
+    }
+    
+    // Writes chunks first..last to numbered files named <prefix>NNN.txt.
+    // Returns the number of chunks written, or -1.
+    int exportFiles(const std::string& prefix, int first, int last) {
+        if (!clampRange(first, last)) return -1;
+        
+        int width = std::to_string(total_chunks).size();
+        for (int pos = first; pos <= last; pos++) {
+            std::string number = std::to_string(pos);
+            std::string path = prefix + std::string(width - number.size(), '0') + number + ".txt";
+            int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                std::cerr << "Error: Could not create " << path << std::endl;
+                return -1;
+            }
+            
+            size_t start = chunk_starts[pos - 1];
+            size_t length = ((pos < total_chunks) ? chunk_starts[pos] : textLength()) - start;
+            bool ok = mapped_file.isOpen() && copyRange(fd, mapped_file.descriptor(), start, length);
+            if (!ok) {
+                std::string_view chunk = getChunkAtPosition(pos);
+                struct iovec piece = {const_cast<char*>(chunk.data()), chunk.size()};
+                ok = (lseek(fd, 0, SEEK_SET) == 0) && (ftruncate(fd, 0) == 0) && writeAll(fd, &piece, 1);
+            }
+            if (::close(fd) != 0 || !ok) {
+                std::cerr << "Error: Could not write " << path << std::endl;
+                return -1;
+            }
+        }
+        return std::max(0, last - first + 1);
+    }
+    
+    // Copies part of a file inside the kernel (or as a reflink, where the
+    // filesystem supports it); false if this kernel or filesystem can't
+    static bool copyRange(int out_fd, int in_fd, size_t start, size_t length) {
+        loff_t offset = start;
+        size_t end = start + length;
+        while (static_cast<size_t>(offset) < end) {
+            ssize_t n = copy_file_range(in_fd, &offset, out_fd, nullptr, end - offset, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+        }
+        return true;
+    }
+    
+    void printPrompt() {
+        std::cout << "Command (Enter=next unused, R=recopy, P=prev, N=next, F=first, L=last, I=invert, A=add, U=usage, Q=quit): " << std::flush;
+    }
+    
     void run() {
-        std::string input;
+        std::string line;
         bool auto_exit = false;
+        bool timing = false;
+        auto command_time = std::chrono::steady_clock::now();
         
         while (true) {
             copyToClipboard();
             showStatus();
             
-            // Check if we're at the final chunk and should auto-exit
-            if (isAtFinalChunk() && !hasUnusedChunks()) {
+            // Check if we're at the final chunk and should auto-exit; a followed
+            // file may still grow, so follow mode never does
+            if (!follow_mode && isAtFinalChunk() && !hasUnusedChunks()) {
                 std::cout << "✓ All chunks processed. Auto-exiting..." << std::endl;
                 auto_exit = true;
                 break;
@@ -511,16 +1693,25 @@ public:
                 std::cout << "⚠ All chunks have been used!" << std::endl;
             }
             
-            std::cout << "Command (Enter=next unused, R=recopy, P=prev, N=next, F=first, L=last, I=invert, A=add, U=usage, Q=quit): ";
+            if (timing) {
+                latency.record(std::chrono::steady_clock::now() - command_time);
+            }
+            
+            printPrompt();
             
-            std::getline(std::cin, input);
+            bool got_line = input.readLine(line);
+            if (!got_line && follow_mode) {
+                break; // no auto-exit while following, so stop at end of input
+            }
+            command_time = std::chrono::steady_clock::now();
+            timing = report_latency;
             
-            if (!processCommand(input)) {
+            if (!processCommand(line)) {
                 break;
             }
             
             // After processing command, check for auto-exit condition again
-            if (isAtFinalChunk() && getCurrentChunk().empty()) {
+            if (!follow_mode && isAtFinalChunk() && getCurrentChunk().empty()) {
                 std::cout << "✓ Reached end of text. Auto-exiting..." << std::endl;
                 auto_exit = true;
                 break;
@@ -531,24 +1722,218 @@ public:
             std::cout << "Session completed successfully!" << std::endl;
             std::cout << "Processed " << used_chunks.size() << "/" << total_chunks << " chunks" << std::endl;
         }
+        
+        if (report_latency) {
+            latency.print(std::cout);
+        }
+    }
+};
+
+// Runs tasks 0..count-1 on a fixed number of threads. Each thread starts
+// with an interleaved share of the tasks and runs them lowest first; a thread
+// that runs out steals the highest task left in another thread's queue, so a
+// few large inputs don't leave the other threads idle.
+class WorkStealingPool {
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+public:
+    static void run(size_t count, unsigned threads, const std::function<void(size_t)>& task) {
+        std::vector<Queue> queues(threads);
+        for (size_t i = 0; i < count; i++) {
+            queues[i % threads].tasks.push_back(i);
+        }
+        
+        auto take = [&](unsigned self, size_t& index) {
+            {
+                std::lock_guard<std::mutex> lock(queues[self].mutex);
+                if (!queues[self].tasks.empty()) {
+                    index = queues[self].tasks.front();
+                    queues[self].tasks.pop_front();
+                    return true;
+                }
+            }
+            // Nothing is ever added, so an empty queue stays empty
+            for (unsigned offset = 1; offset < threads; offset++) {
+                Queue& victim = queues[(self + offset) % threads];
+                std::lock_guard<std::mutex> lock(victim.mutex);
+                if (!victim.tasks.empty()) {
+                    index = victim.tasks.back();
+                    victim.tasks.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        };
+        
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                size_t index;
+                while (take(t, index)) task(index);
+            });
+        }
+        for (std::thread& worker : workers) worker.join();
     }
 };
 
+// --export with several input files. Every file is loaded and laid out on a
+// pool thread, and with --export=files also written there. NUL and JSON Lines
+// output is one stream in input order: the main thread writes each file once
+// it and all files before it are ready, and the pool stays at most a few
+// files ahead, which bounds the number of open mappings.
+// configure applies the chunking options to each file's chunker.
+static int exportBatch(const std::vector<std::string>& filenames, bool tail_mode, size_t chunk_size, bool stream_mode,
+                       const std::function<void(TextChunker&)>& configure,
+                       const std::string& format, const std::string& output, int first, int last, unsigned jobs) {
+    auto start_time = std::chrono::steady_clock::now();
+    size_t count = filenames.size();
+    bool ordered = (format != "files");
+    
+    // More threads than files or cores would only wait
+    jobs = std::min<size_t>({jobs, count, std::max(1u, std::thread::hardware_concurrency())});
+    
+    int out_fd = STDOUT_FILENO;
+    if (ordered && !output.empty()) {
+        out_fd = ::open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out_fd < 0) {
+            std::cerr << "Error: Could not create " << output << std::endl;
+            return 1;
+        }
+    }
+    
+    // Files are numbered in the output names: <prefix><file>_<chunk>.txt
+    std::string prefix = output.empty() ? "chunk_" : output;
+    int width = std::to_string(count).size();
+    
+    enum { Pending, Ready, Failed };
+    std::vector<std::unique_ptr<TextChunker>> loaded(count);
+    std::vector<int> state(count, Pending);
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t written = 0;
+    const size_t window = 4 * jobs;
+    std::atomic<long> exported(0);
+    std::atomic<bool> failed(false);
+    
+    auto task = [&](size_t i) {
+        if (ordered) {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]() { return i < written + window; });
+        }
+        
+        auto chunker = std::make_unique<TextChunker>(tail_mode, chunk_size, stream_mode);
+        chunker->setHeadless(true);
+        configure(*chunker);
+        bool ok = chunker->loadText(filenames[i]);
+        if (ok && !ordered) {
+            std::string number = std::to_string(i + 1);
+            int chunks = chunker->exportFiles(prefix + std::string(width - number.size(), '0') +
+                                              number + "_", first, last);
+            ok = (chunks >= 0);
+            if (ok) exported += chunks;
+            chunker.reset();
+        }
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        loaded[i] = std::move(chunker);
+        state[i] = ok ? Ready : Failed;
+        changed.notify_all();
+    };
+    std::thread pool([&]() { WorkStealingPool::run(count, jobs, task); });
+    
+    for (size_t i = 0; ordered && i < count; i++) {
+        std::unique_ptr<TextChunker> chunker;
+        bool ok;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]() { return state[i] != Pending; });
+            chunker = std::move(loaded[i]);
+            ok = (state[i] == Ready);
+        }
+        
+        int chunks = ok ? chunker->exportStream(format, out_fd, first, last, filenames[i]) : -1;
+        if (chunks >= 0) exported += chunks;
+        else failed = true;
+        chunker.reset(); // Unmaps the file before the next one is let in
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        written = i + 1;
+        changed.notify_all();
+    }
+    pool.join();
+    
+    for (int file_state : state) {
+        if (file_state == Failed) failed = true;
+    }
+    if (out_fd != STDOUT_FILENO && ::close(out_fd) != 0) {
+        std::cerr << "Error: Could not write " << output << std::endl;
+        failed = true;
+    }
+    
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    std::cout << "Exported " << exported << " chunks from " << count << " files in "
+              << std::fixed << std::setprecision(3) << elapsed.count() << " s ("
+              << jobs << " threads)" << std::endl;
+    return failed ? 1 : 0;
+}
+
 int main(int argc, char* argv[]) {
     bool tail_mode = false;
     size_t chunk_size = 20000;
     std::string filename;
     
-    std::cout << "Text Chunker with Native Clipboard Support" << std::endl;
-    std::cout << "==========================================" << std::endl;
-    
-    // Parse arguments
-    if (argc > 1) {
-        if (std::string(argv[1]) == "--help" || std::string(argv[1]) == "-h") {
-            std::cout << "Usage: " << argv[0] << " [tail_mode] [chunk_size] [filename]" << std::endl;
+    // Parse arguments: --options anywhere, then positional arguments
+    bool stream_mode = false;
+    bool report_latency = false;
+    bool sync_journal = false;
+    bool follow = false;
+    bool follow_copy = false;
+    bool count_codepoints = false;
+    bool count_tokens = false;
+    std::string vocabulary_path;
+    BoundaryMode boundary = BoundaryMode::Fixed;
+    size_t slack = 20;
+    std::string export_format, export_output;
+    int export_first = 1, export_last = 0;
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            std::cout << "Usage: " << argv[0] << " [options] [tail_mode] [chunk_size] [filename...]" << std::endl;
             std::cout << "  tail_mode: 0 for head mode, 1 for tail mode (default: 0)" << std::endl;
-            std::cout << "  chunk_size: size of each chunk in characters (default: 20000)" << std::endl;
-            std::cout << "  filename: file to read from (default: clipboard)" << std::endl;
+            std::cout << "  chunk_size: size of each chunk in bytes, never splitting a UTF-8" << std::endl;
+            std::cout << "              character, or in characters or tokens (default: 20000)" << std::endl;
+            std::cout << "  filename: file to read from, - for stdin (default: clipboard);" << std::endl;
+            std::cout << "            --export takes any number of files" << std::endl;
+            std::cout << std::endl;
+            std::cout << "Options:" << std::endl;
+            std::cout << "  --codepoints: count chunk_size in UTF-8 characters instead of bytes" << std::endl;
+            std::cout << "  --tokens: count chunk_size in LLM tokens, estimated from word lengths" << std::endl;
+            std::cout << "  --vocab=FILE: count tokens exactly with a tiktoken BPE vocabulary" << std::endl;
+            std::cout << "            (e.g. cl100k_base.tiktoken); implies --tokens" << std::endl;
+            std::cout << "  --boundary=line|paragraph|sentence: end each chunk after the last" << std::endl;
+            std::cout << "            line break, blank line or sentence end near its end" << std::endl;
+            std::cout << "  --slack=PCT: how much of the end of a chunk is searched for that" << std::endl;
+            std::cout << "            break, in percent of the chunk (default: 20)" << std::endl;
+            std::cout << "  --stream: page through the file instead of loading it (for inputs" << std::endl;
+            std::cout << "            larger than RAM; stdin is spooled to the /tmp file)" << std::endl;
+            std::cout << "  --latency: print a command-to-prompt latency histogram on exit" << std::endl;
+            std::cout << "  --sync-journal: write the /tmp journal on the interactive thread" << std::endl;
+            std::cout << "  --follow: keep watching the file and chunk text appended to it" << std::endl;
+            std::cout << "  --follow-copy: like --follow, and copy each new complete chunk" << std::endl;
+            std::cout << "  --export=files|nul|jsonl: write the chunks out and exit, without" << std::endl;
+            std::cout << "            a clipboard or display server; messages go to stderr" << std::endl;
+            std::cout << "  --output=PATH: file prefix for files (default chunk_), or the" << std::endl;
+            std::cout << "            output file for nul and jsonl (default stdout)" << std::endl;
+            std::cout << "  --range=A-B: export chunks A through B only (A-, A or -B work too)" << std::endl;
+            std::cout << "  --jobs=N: threads for exporting several files (default: all cores);" << std::endl;
+            std::cout << "            files are named <output><file>_<chunk>.txt, and nul/jsonl" << std::endl;
+            std::cout << "            output keeps the order of the files" << std::endl;
             std::cout << std::endl;
             std::cout << "Features:" << std::endl;
             std::cout << "  - Native X11/Wayland clipboard support" << std::endl;
@@ -557,30 +1942,181 @@ int main(int argc, char* argv[]) {
             std::cout << "  - Auto-saves to /tmp file" << std::endl;
             std::cout << "  - Auto-exits when all chunks processed" << std::endl;
             return 0;
+        } else if (arg == "--stream") {
+            stream_mode = true;
+        } else if (arg == "--codepoints") {
+            count_codepoints = true;
+        } else if (arg == "--tokens") {
+            count_tokens = true;
+        } else if (arg.compare(0, 8, "--vocab=") == 0) {
+            count_tokens = true;
+            vocabulary_path = arg.substr(8);
+        } else if (arg.compare(0, 11, "--boundary=") == 0) {
+            std::string mode = arg.substr(11);
+            if (mode == "line") boundary = BoundaryMode::Line;
+            else if (mode == "paragraph") boundary = BoundaryMode::Paragraph;
+            else if (mode == "sentence") boundary = BoundaryMode::Sentence;
+            else {
+                std::cerr << "Error: --boundary takes line, paragraph or sentence" << std::endl;
+                return 1;
+            }
+        } else if (arg.compare(0, 8, "--slack=") == 0) {
+            if (!parseNumber(arg.substr(8), 3, slack) || slack == 0 || slack > 100) {
+                std::cerr << "Error: --slack needs a percentage from 1 to 100" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--latency") {
+            report_latency = true;
+        } else if (arg == "--sync-journal") {
+            sync_journal = true;
+        } else if (arg == "--follow") {
+            follow = true;
+        } else if (arg == "--follow-copy") {
+            follow_copy = true;
+        } else if (arg.compare(0, 9, "--export=") == 0) {
+            export_format = arg.substr(9);
+            if (export_format != "files" && export_format != "nul" && export_format != "jsonl") {
+                std::cerr << "Error: --export takes files, nul or jsonl" << std::endl;
+                return 1;
+            }
+        } else if (arg.compare(0, 9, "--output=") == 0) {
+            export_output = arg.substr(9);
+        } else if (arg.compare(0, 8, "--range=") == 0) {
+            std::string range = arg.substr(8);
+            size_t dash = range.find('-');
+            std::string from = range.substr(0, dash);
+            std::string to = (dash == std::string::npos) ? from : range.substr(dash + 1);
+            size_t first = 1;
+            size_t last = 0;
+            if ((from.empty() && to.empty()) || (!from.empty() && !parseNumber(from, 9, first)) ||
+                (!to.empty() && !parseNumber(to, 9, last))) {
+                std::cerr << "Error: Invalid range " << range << std::endl;
+                return 1;
+            }
+            export_first = first;
+            export_last = last;
+        } else if (arg.compare(0, 7, "--jobs=") == 0) {
+            std::string count = arg.substr(7);
+            if (count.empty() || count.size() > 9 || !std::all_of(count.begin(), count.end(), ::isdigit) ||
+                std::stoul(count) == 0) {
+                std::cerr << "Error: --jobs needs a positive number" << std::endl;
+                return 1;
+            }
+            jobs = std::stoul(count);
+        } else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+            std::cerr << "Error: Unknown option " << arg << std::endl;
+            return 1;
+        } else {
+            args.push_back(arg);
         }
-        tail_mode = (std::string(argv[1]) == "1");
     }
     
-    if (argc > 2) {
-        chunk_size = std::stoul(argv[2]);
+    if (args.size() > 0) {
+        tail_mode = (args[0] == "1");
+    }
+    
+    if (args.size() > 1) {
+        chunk_size = std::stoul(args[1]);
         if (chunk_size == 0) {
             std::cerr << "Error: Chunk size must be > 0" << std::endl;
             return 1;
         }
     }
     
-    if (argc > 3) {
-        filename = argv[3];
+    if (args.size() > 2) {
+        filename = args[2];
+    }
+    
+    // In export mode stdout may carry the chunks, so everything else goes to stderr
+    if (!export_format.empty()) {
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+    
+    std::cout << "Text Chunker with Native Clipboard Support" << std::endl;
+    std::cout << "==========================================" << std::endl;
+    
+    if (stream_mode && filename.empty()) {
+        std::cerr << "Error: --stream needs a filename (or - for stdin)" << std::endl;
+        return 1;
+    }
+    
+    if (count_tokens && count_codepoints) {
+        std::cerr << "Error: --tokens and --codepoints can't be combined" << std::endl;
+        return 1;
+    }
+    
+    // Loaded once and shared by every chunker
+    std::shared_ptr<const TokenRanks> vocabulary;
+    if (!vocabulary_path.empty()) {
+        vocabulary = Tokenizer::loadVocabulary(vocabulary_path);
+        if (!vocabulary) {
+            std::cerr << "Error: Could not read a vocabulary from " << vocabulary_path << std::endl;
+            return 1;
+        }
+        std::cout << "Loaded " << vocabulary->size() << " tokens from " << vocabulary_path << std::endl;
+    }
+    
+    auto configure = [&](TextChunker& chunker) {
+        chunker.setCountCodepoints(count_codepoints);
+        chunker.setCountTokens(count_tokens, vocabulary);
+        chunker.setBoundaryMode(boundary, slack);
+    };
+    
+    if (args.size() > 3) {
+        std::vector<std::string> filenames(args.begin() + 2, args.end());
+        if (export_format.empty()) {
+            std::cerr << "Error: Several files can only be chunked with --export" << std::endl;
+            return 1;
+        }
+        if (std::find(filenames.begin(), filenames.end(), "-") != filenames.end()) {
+            std::cerr << "Error: stdin (-) can't be one of several files" << std::endl;
+            return 1;
+        }
+        return exportBatch(filenames, tail_mode, chunk_size, stream_mode, configure,
+                           export_format, export_output, export_first, export_last, jobs);
+    }
+    
+    if ((follow || follow_copy) && (filename.empty() || filename == "-")) {
+        std::cerr << "Error: --follow needs a file to watch" << std::endl;
+        return 1;
     }
     
-    TextChunker chunker(tail_mode, chunk_size);
+    TextChunker chunker(tail_mode, chunk_size, stream_mode);
+    chunker.setSyncJournal(sync_journal);
+    chunker.setLatencyReport(report_latency);
+    chunker.setFollow(follow, follow_copy);
+    chunker.setHeadless(!export_format.empty());
+    configure(chunker);
     
     if (!chunker.loadText(filename)) {
         return 1;
     }
     
+    if (export_format == "files") {
+        int chunks = chunker.exportFiles(export_output.empty() ? "chunk_" : export_output,
+                                         export_first, export_last);
+        if (chunks < 0) return 1;
+        std::cout << "Exported " << chunks << " chunks" << std::endl;
+        return 0;
+    } else if (!export_format.empty()) {
+        int fd = STDOUT_FILENO;
+        if (!export_output.empty()) {
+            fd = ::open(export_output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                std::cerr << "Error: Could not create " << export_output << std::endl;
+                return 1;
+            }
+        }
+        int chunks = chunker.exportStream(export_format, fd, export_first, export_last);
+        if (fd != STDOUT_FILENO && ::close(fd) != 0) chunks = -1;
+        if (chunks < 0) return 1;
+        std::cout << "Exported " << chunks << " chunks" << std::endl;
+        return 0;
+    }
+    
     std::cout << "Text chunker loaded. Mode: " << (tail_mode ? "tail" : "head") 
-              << ", Chunk size: " << chunk_size << " chars" << std::endl;
+              << ", Chunk size: " << chunk_size << (count_tokens ? " tokens" : count_codepoints ? " characters" : " bytes")
+              << std::endl;
     std::cout << "Features: Duplicate prevention, Text addition (A), Auto-save to /tmp" << std::endl;
     std::cout << std::endl;
     
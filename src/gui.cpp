@@ -4,7 +4,7 @@
 #include <QtWidgets/QVBoxLayout>
 #include <QtWidgets/QHBoxLayout>
 #include <QtWidgets/QLabel>
-#include <QtWidgets/QScrollArea>
+#include <QtWidgets/QPlainTextEdit>
 #include <QtWidgets/QSpinBox>
 #include <QtWidgets/QPushButton>
 #include <QtWidgets/QStatusBar>
@@ -15,36 +15,78 @@
 #include <QtGui/QKeySequence>
 #include <QtGui/QShortcut>
 #include <QtCore/QTimer>
+#include <QtCore/QProcess>
+#include <QtCore/QMimeData>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+#include <QtCore/QElapsedTimer>
+#include <QtGui/QTextDocument>
 #include <fstream>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
 #include <algorithm>
 #include <iostream>
 #include <ctime>
 
+#include "cli/chunking.h"
+
 class TextChunkerWindow : public QMainWindow {
     Q_OBJECT
 
 private:
-    std::string text;
+    std::string_view text;    // Text being chunked; backed by main()'s buffer or loaded_text
+    std::string loaded_text;  // Owned text loaded with V / Ctrl+Super+V
     size_t chunk_size;
     bool tail_mode;
     bool inverted;
     int current_chunk;
     int total_chunks;
 
-    QLabel* chunkLabel;
+    // Shows the current chunk. Its document lays out only the blocks that
+    // are scrolled into view, so a big chunk costs about as much as a screenful.
+    QPlainTextEdit* chunkView;
     QLabel* infoLabel;
     QLabel* helpLabel;
     QSpinBox* chunkSizeSpinBox;
     QPushButton* applyButton;
-    QScrollArea* scrollArea;
+    QTimer* chunkSizeTimer;  // Applies the spin box value once it stops changing
     QClipboard* clipboard;
 
+    // Reads the clipboard through wl-paste or xclip while a load is running,
+    // so a slow clipboard owner or a big payload never blocks the event loop.
+    // The text collects in incoming_text and replaces text once complete.
+    QProcess* clipboardReader = nullptr;
+    std::string incoming_text;
+
     // Global shortcuts
     QShortcut* globalNextShortcut;
     QShortcut* globalPrevShortcut;
     QShortcut* globalNewTextShortcut;
 
+    // A chunk ready for display: its UTF-16 text, shared by the view and the
+    // clipboard, and a document the view can switch to without converting or
+    // splitting the text into blocks. Keyed by the chunk's bytes. An entry
+    // without a document is still being built by the prefetcher.
+    struct PreparedChunk {
+        std::string_view source;
+        QString text;
+        std::unique_ptr<QTextDocument> document;
+    };
+
+    // The current chunk and its neighbours. The neighbours are prepared on a
+    // single background thread while the user reads, so a keypress only
+    // swaps documents. Finished ones wait in prefetched until the GUI thread
+    // takes them, so every document has an owner even if the window closes
+    // first. Prefetch tasks read text, so the pool is drained before text is
+    // replaced or the window destroyed.
+    std::vector<PreparedChunk> prepared;
+    QThreadPool prefetcher;
+    std::mutex prefetched_mutex;
+    std::vector<PreparedChunk> prefetched;
+
     void recalcChunks() {
         total_chunks = (text.length() + chunk_size - 1) / chunk_size;
         if (total_chunks == 0) total_chunks = 1;
@@ -52,7 +94,8 @@ private:
         if (current_chunk < 1) current_chunk = 1;
     }
 
-    std::string getChunk(int pos) {
+    // Returns a view into text; it is invalidated when new text is loaded
+    std::string_view getChunk(int pos) {
         if (pos < 1 || pos > total_chunks) return "";
         size_t start_pos, end_pos;
         if (tail_mode ^ inverted) {
@@ -65,9 +108,109 @@ private:
         return text.substr(start_pos, end_pos - start_pos);
     }
 
+    // Builds the display form of a chunk; runs on any thread
+    static PreparedChunk prepare(std::string_view chunk, const QFont& font) {
+        PreparedChunk result;
+        result.source = chunk;
+        result.text = QString::fromUtf8(chunk.data(), chunk.size());
+        result.document = std::make_unique<QTextDocument>();
+        result.document->setDocumentLayout(new QPlainTextDocumentLayout(result.document.get()));
+        result.document->setUndoRedoEnabled(false);
+        result.document->setDefaultFont(font);
+        result.document->setDocumentMargin(15);
+        result.document->setPlainText(result.text);
+        return result;
+    }
+
+    PreparedChunk* findPrepared(std::string_view chunk) {
+        for (PreparedChunk& entry : prepared) {
+            if (entry.source.data() == chunk.data() && entry.source.size() == chunk.size()) return &entry;
+        }
+        return nullptr;
+    }
+
+    // Prepares the chunk here if the prefetcher has not delivered it yet.
+    // The reference is invalidated by prefetchAround.
+    PreparedChunk& preparedChunk(std::string_view chunk) {
+        PreparedChunk* entry = findPrepared(chunk);
+        if (!entry) {
+            prepared.push_back({chunk, {}, nullptr});
+            entry = &prepared.back();
+        }
+        if (!entry->document) *entry = prepare(chunk, chunkView->font());
+        return *entry;
+    }
+
+    // The view may still show a dropped document, so it is deleted once
+    // control returns to the event loop, or with the window
+    void discardDocument(std::unique_ptr<QTextDocument> document) {
+        if (!document) return;
+        QTextDocument* dropped = document.release();
+        dropped->setParent(this);
+        dropped->deleteLater();
+    }
+
+    // Drops prepared chunks that are no longer next to pos and queues the
+    // neighbours that are missing
+    void prefetchAround(int pos) {
+        std::string_view wanted[3] = {getChunk(pos), getChunk(pos - 1), getChunk(pos + 1)};
+        auto isWanted = [&](const PreparedChunk& entry) {
+            for (std::string_view chunk : wanted) {
+                if (entry.source.data() == chunk.data() && entry.source.size() == chunk.size()) return true;
+            }
+            return false;
+        };
+        for (PreparedChunk& entry : prepared) {
+            if (!isWanted(entry)) discardDocument(std::move(entry.document));
+        }
+        prepared.erase(std::remove_if(prepared.begin(), prepared.end(),
+                                      [&](const PreparedChunk& entry) { return !isWanted(entry); }),
+                       prepared.end());
+
+        QFont font = chunkView->font();
+        QThread* guiThread = thread();
+        for (std::string_view chunk : {wanted[1], wanted[2]}) {
+            if (chunk.empty() || findPrepared(chunk)) continue;
+            prepared.push_back({chunk, {}, nullptr});
+            prefetcher.start([this, chunk, font, guiThread]() {
+                PreparedChunk result = prepare(chunk, font);
+                result.document->moveToThread(guiThread);
+                {
+                    std::lock_guard<std::mutex> lock(prefetched_mutex);
+                    prefetched.push_back(std::move(result));
+                }
+                QMetaObject::invokeMethod(this, [this]() { adoptPrefetched(); }, Qt::QueuedConnection);
+            });
+        }
+    }
+
+    // Takes finished prefetches on the GUI thread, except those no longer
+    // wanted or meanwhile prepared synchronously
+    void adoptPrefetched() {
+        std::vector<PreparedChunk> finished;
+        {
+            std::lock_guard<std::mutex> lock(prefetched_mutex);
+            finished.swap(prefetched);
+        }
+        for (PreparedChunk& result : finished) {
+            PreparedChunk* entry = findPrepared(result.source);
+            if (entry && !entry->document) *entry = std::move(result);
+        }
+    }
+
+    // Forgets everything prepared for the current text before it is replaced
+    void dropPrepared() {
+        prefetcher.clear();
+        prefetcher.waitForDone();
+        prefetched.clear();
+        for (PreparedChunk& entry : prepared) discardDocument(std::move(entry.document));
+        prepared.clear();
+    }
+
     void updateUI() {
-        std::string chunk = getChunk(current_chunk);
-        chunkLabel->setText(QString::fromStdString(chunk));
+        std::string_view chunk = getChunk(current_chunk);
+        const PreparedChunk& shown = preparedChunk(chunk);
+        chunkView->setDocument(shown.document.get());
 
         QString info = QString("Chunk %1/%2 | %3 total chars | %4 chars per chunk")
                            .arg(current_chunk)
@@ -86,7 +229,7 @@ private:
         statusBar()->showMessage(QString("Copied %1 characters to clipboard").arg(chunk.length()));
 
         // Copy to clipboard automatically
-        clipboard->setText(QString::fromStdString(chunk));
+        clipboard->setText(shown.text);
 
         // Flash the window to indicate global hotkey worked
         if (!isActiveWindow()) {
@@ -98,6 +241,8 @@ private:
                 setWindowOpacity(1.0);
             });
         }
+
+        prefetchAround(current_chunk);
     }
 
     void goNext() {
@@ -117,13 +262,63 @@ private:
     }
 
     void loadNewText() {
-        std::string newText = clipboard->text().toStdString();
+#ifdef Q_OS_LINUX
+        if (clipboardReader) {
+            // A new request replaces one that is still running, which may be stuck on its owner
+            clipboardReader->disconnect(this);
+            clipboardReader->kill();
+            clipboardReader->deleteLater();
+        }
+        incoming_text.clear();
+
+        clipboardReader = new QProcess(this);
+        connect(clipboardReader, &QProcess::readyReadStandardOutput, this, [this]() {
+            QByteArray data = clipboardReader->readAllStandardOutput();
+            incoming_text.append(data.constData(), data.size());
+            statusBar()->showMessage(QString("Loading clipboard... %1 KB").arg(incoming_text.size() / 1024));
+        });
+        connect(clipboardReader, &QProcess::finished, this, [this](int exitCode, QProcess::ExitStatus status) {
+            finishClipboardRead(status == QProcess::NormalExit && exitCode == 0);
+        });
+        connect(clipboardReader, &QProcess::errorOccurred, this, [this](QProcess::ProcessError error) {
+            if (error == QProcess::FailedToStart) finishClipboardRead(false);
+        });
+
+        if (qEnvironmentVariableIsSet("WAYLAND_DISPLAY")) {
+            clipboardReader->start("wl-paste", {"--no-newline", "--type", "text"});
+        } else {
+            clipboardReader->start("xclip", {"-selection", "clipboard", "-out", "-target", "UTF8_STRING"});
+        }
+        statusBar()->showMessage("Loading clipboard...");
+#else
+        setLoadedText(clipboardText());
+#endif
+    }
+
+    // Without a helper, or when it failed, asks Qt, which waits for the owner
+    std::string clipboardText() {
+        const QMimeData* mime = clipboard->mimeData();
+        if (!mime || !mime->hasText()) return "";
+        return mime->text().toStdString();
+    }
+
+    void finishClipboardRead(bool succeeded) {
+        clipboardReader->deleteLater();
+        clipboardReader = nullptr;
+        std::string newText = succeeded ? std::move(incoming_text) : clipboardText();
+        incoming_text = std::string();
+        setLoadedText(std::move(newText));
+    }
+
+    void setLoadedText(std::string newText) {
         if (newText.empty()) {
             statusBar()->showMessage("No text in clipboard!", 3000);
             return;
         }
         
-        text = newText;
+        dropPrepared();
+        loaded_text = std::move(newText);
+        text = loaded_text;
         current_chunk = 1;
         if (tail_mode) {
             recalcChunks();
@@ -152,10 +347,11 @@ protected:
             goPrev();
             break;
         case Qt::Key_R: // recopy
-        case Qt::Key_C: // also recopy
-            clipboard->setText(QString::fromStdString(getChunk(current_chunk)));
+        case Qt::Key_C: { // also recopy
+            clipboard->setText(preparedChunk(getChunk(current_chunk)).text);
             statusBar()->showMessage("Recopied to clipboard", 2000);
             break;
+        }
         case Qt::Key_I: // invert
             inverted = !inverted;
             current_chunk = total_chunks - current_chunk + 1;
@@ -182,24 +378,79 @@ protected:
     }
 
 private slots:
+    // Holding an arrow or typing a number steps through many values; only
+    // the one the spin box settles on is applied
+    void onChunkSizeEdited() {
+        chunkSizeTimer->start();
+    }
+
     void onChunkSizeChanged() {
-        chunk_size = chunkSizeSpinBox->value();
+        size_t size = chunkSizeSpinBox->value();
+        if (size == chunk_size) return;
+
+        prefetcher.clear();  // Queued neighbours of the old chunking are not wanted
+        chunk_size = size;
         recalcChunks();
         updateUI();
     }
 
 public:
-    TextChunkerWindow(const std::string& inputText, size_t size, bool tail)
+    TextChunkerWindow(std::string_view inputText, size_t size, bool tail)
         : text(inputText), chunk_size(size), tail_mode(tail), inverted(false), current_chunk(1) {
 
         recalcChunks();
         if (tail_mode) current_chunk = total_chunks;
+        prefetcher.setMaxThreadCount(1);
 
         setupUI();
         setupGlobalShortcuts();
         updateUI();
     }
 
+    // Prepared documents go with their members; the view must not keep
+    // pointing at one of them until the base class deletes it
+    ~TextChunkerWindow() override {
+        prefetcher.clear();
+        prefetcher.waitForDone();
+        chunkView->setDocument(nullptr);
+    }
+
+    // --benchmark: steps through up to count chunks as the Next key does and
+    // prints how long each step took, from the key until the chunk is
+    // painted. The prefetcher finishes between steps, as it would while the
+    // chunk is being read; the throughput counts that time too.
+    void benchmarkNavigation(int count) {
+        std::vector<qint64> steps;
+        QElapsedTimer total;
+        QElapsedTimer step;
+        size_t bytes = 0;
+        total.start();
+        for (int i = 0; i < count; i++) {
+            prefetcher.waitForDone();
+            QCoreApplication::processEvents();
+            if (current_chunk == ((tail_mode ^ inverted) ? 1 : total_chunks)) break;
+
+            step.start();
+            goNext();
+            chunkView->viewport()->repaint();
+            steps.push_back(step.nsecsElapsed());
+            bytes += getChunk(current_chunk).size();
+        }
+        if (steps.empty()) {
+            std::cout << "Nothing to navigate: the text has one chunk" << std::endl;
+            return;
+        }
+
+        double seconds = total.nsecsElapsed() / 1e9;
+        std::sort(steps.begin(), steps.end());
+        auto ms = [](qint64 ns) { return ns / 1e6; };
+        std::cout << "Navigated " << steps.size() << " chunks of " << chunk_size << " bytes in a "
+                  << text.length() << "-byte text in " << seconds << " s: " << steps.size() / seconds << " chunks/s, "
+                  << bytes / seconds / 1e6 << " MB/s" << std::endl;
+        std::cout << "Per step: median " << ms(steps[steps.size() / 2]) << " ms, 99th percentile "
+                  << ms(steps[steps.size() * 99 / 100]) << " ms, max " << ms(steps.back()) << " ms" << std::endl;
+    }
+
 private:
     void setupGlobalShortcuts() {
         // Global shortcut for next chunk: Ctrl+Shift+V
@@ -250,23 +501,25 @@ private:
         spinBoxFont.setPointSize(14);
         chunkSizeSpinBox->setFont(spinBoxFont);
         connect(chunkSizeSpinBox, QOverload<int>::of(&QSpinBox::valueChanged),
-                this, &TextChunkerWindow::onChunkSizeChanged);
+                this, &TextChunkerWindow::onChunkSizeEdited);
+        chunkSizeTimer = new QTimer(this);
+        chunkSizeTimer->setSingleShot(true);
+        chunkSizeTimer->setInterval(300);
+        connect(chunkSizeTimer, &QTimer::timeout, this, &TextChunkerWindow::onChunkSizeChanged);
         controlsLayout->addWidget(chunkSizeSpinBox);
         
         controlsLayout->addStretch();
         mainLayout->addLayout(controlsLayout);
 
-        // Text display area with scroll
-        scrollArea = new QScrollArea(this);
-        scrollArea->setWidgetResizable(true);
-        scrollArea->setHorizontalScrollBarPolicy(Qt::ScrollBarAsNeeded);
-        scrollArea->setVerticalScrollBarPolicy(Qt::ScrollBarAsNeeded);
-
-        chunkLabel = new QLabel();
-        chunkLabel->setWordWrap(true);
-        chunkLabel->setAlignment(Qt::AlignTop | Qt::AlignLeft);
-        chunkLabel->setTextInteractionFlags(Qt::TextSelectableByMouse | Qt::TextSelectableByKeyboard);
-        chunkLabel->setMargin(15);
+        // Text display area; it scrolls by itself
+        chunkView = new QPlainTextEdit(this);
+        chunkView->setReadOnly(true);
+        chunkView->setUndoRedoEnabled(false);
+        chunkView->setLineWrapMode(QPlainTextEdit::WidgetWidth);
+        chunkView->setTextInteractionFlags(Qt::TextSelectableByMouse);
+        chunkView->setFocusPolicy(Qt::NoFocus);  // Keys stay with the window's shortcuts
+        chunkView->setHorizontalScrollBarPolicy(Qt::ScrollBarAsNeeded);
+        chunkView->setVerticalScrollBarPolicy(Qt::ScrollBarAsNeeded);
         
         QFont chunkFont("Consolas", 12);
         if (!chunkFont.exactMatch()) {
@@ -275,10 +528,9 @@ private:
         if (!chunkFont.exactMatch()) {
             chunkFont.setFamily("Courier New");  // Windows fallback
         }
-        chunkLabel->setFont(chunkFont);
+        chunkView->setFont(chunkFont);
 
-        scrollArea->setWidget(chunkLabel);
-        mainLayout->addWidget(scrollArea, 1);  // Give it all available space
+        mainLayout->addWidget(chunkView, 1);  // Give it all available space
 
         // Info section - MUCH BIGGER FONT
         infoLabel = new QLabel(this);
@@ -318,18 +570,13 @@ private:
                 color: #ffffff;
                 background-color: transparent;
             }
-            QLabel#chunkLabel {
+            QPlainTextEdit#chunkView {
                 background-color: #2d2d2d;
+                color: #ffffff;
                 border: 2px solid #404040;
                 border-radius: 8px;
-                padding: 15px;
                 selection-background-color: #0078d4;
             }
-            QScrollArea {
-                background-color: #2d2d2d;
-                border: 2px solid #404040;
-                border-radius: 8px;
-            }
             QScrollBar:vertical {
                 background: #404040;
                 width: 12px;
@@ -364,7 +611,7 @@ private:
         )");
 
         // Set object names for styling
-        chunkLabel->setObjectName("chunkLabel");
+        chunkView->setObjectName("chunkView");
 
         // Setup status bar
         statusBar()->setSizeGripEnabled(true);
@@ -380,27 +627,52 @@ int main(int argc, char* argv[]) {
     bool tail_mode = false;
     size_t chunk_size = 20000;
     std::string filename;
+    size_t benchmark_steps = 0; // --benchmark=N: time N navigations and exit
+
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 12, "--benchmark=") == 0) {
+            if (!parseNumber(arg.substr(12), 9, benchmark_steps) || benchmark_steps == 0) {
+                std::cerr << "Error: --benchmark needs a positive number of steps" << std::endl;
+                return 1;
+            }
+        } else {
+            args.push_back(arg);
+        }
+    }
 
-    if (argc > 1) tail_mode = (std::string(argv[1]) == "1");
-    if (argc > 2) {
-        chunk_size = std::stoul(argv[2]);
+    if (args.size() > 0) tail_mode = (args[0] == "1");
+    if (args.size() > 1) {
+        chunk_size = std::stoul(args[1]);
         if (chunk_size == 0) {
             std::cerr << "Error: Chunk size must be > 0" << std::endl;
             return 1;
         }
     }
-    if (argc > 3) filename = argv[3];
+    if (args.size() > 2) filename = args[2];
 
-    std::string inputText;
+    // Both buffers must outlive the window, which only keeps a view of the text
+    MappedFile mappedFile;
+    std::string ownedText;
+    std::string_view inputText;
     if (!filename.empty()) {
-        std::ifstream file(filename);
-        if (!file) {
-            std::cerr << "Error: Could not open file " << filename << std::endl;
-            return 1;
+        if (mappedFile.open(filename)) {
+            inputText = mappedFile.view();
+        } else {
+            std::ifstream file(filename, std::ios::binary);
+            if (!file) {
+                std::cerr << "Error: Could not open file " << filename << std::endl;
+                return 1;
+            }
+            std::vector<char> buffer(1 << 20);
+            while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0)
+                ownedText.append(buffer.data(), file.gcount());
+            inputText = ownedText;
         }
-        inputText.assign((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
     } else {
-        inputText = QApplication::clipboard()->text().toStdString();
+        ownedText = QApplication::clipboard()->text().toStdString();
+        inputText = ownedText;
     }
 
     if (inputText.empty()) {
@@ -417,6 +689,11 @@ int main(int argc, char* argv[]) {
     int x = (screenGeometry.width() - window.width()) / 2;
     int y = (screenGeometry.height() - window.height()) / 2;
     window.move(x, y);
+
+    if (benchmark_steps > 0) {
+        window.benchmarkNavigation(benchmark_steps);
+        return 0;
+    }
     
     return app.exec();
 }
@@ -0,0 +1,34 @@
+#!/bin/sh
+# --follow on a file that is truncated and then grows again must end up with
+# the file's new content only (200 bytes here), not old text plus new bytes.
+#
+# Usage: tests/follow_truncate.sh path/to/xcli (or path/to/cli)
+set -e
+
+xcli=${1:?usage: $0 path/to/xcli}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+file=$dir/followed.txt
+
+head -c 100 /dev/zero | tr '\0' a > "$file"
+(
+    sleep 0.5
+    : > "$file"
+    sleep 0.5
+    head -c 60 /dev/zero | tr '\0' b >> "$file"
+    sleep 0.5
+    head -c 90 /dev/zero | tr '\0' c >> "$file"
+    sleep 0.5
+    head -c 50 /dev/zero | tr '\0' d >> "$file"
+    sleep 0.5
+    echo L
+    sleep 0.3
+    echo q
+) | timeout 10 "$xcli" --follow 0 40 "$file" > "$dir/out.txt" 2>&1 || true
+
+if ! grep -q "Chunk 5/5 (200 bytes total" "$dir/out.txt"; then
+    echo "FAIL: followed text does not match the regrown file" >&2
+    cat "$dir/out.txt" >&2
+    exit 1
+fi
+echo "PASS: truncate then regrow"
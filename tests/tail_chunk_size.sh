@@ -0,0 +1,38 @@
+#!/bin/sh
+# Tail layout must keep chunk_size as an upper limit on multibyte text, with
+# or without --boundary, also where no break is found within the slack.
+#
+# Usage: tests/tail_chunk_size.sh path/to/xcli
+set -e
+
+xcli=${1:?usage: $0 path/to/xcli}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+input=$dir/input.txt
+
+# Long lines of two- and three-byte characters, so chunk starts land inside
+# characters and most chunks have no line break near their start
+i=0
+while [ $i -lt 200 ]; do
+    printf 'é漢ü字ö語%.0s' $(seq 40) >> "$input"
+    [ $((i % 7)) -eq 0 ] && printf '\n' >> "$input"
+    i=$((i + 1))
+done
+
+size=3001
+for boundary in "" --boundary=line; do
+    rm -f "$dir"/chunk_*
+    "$xcli" --export=files --output="$dir/chunk_" $boundary 1 $size "$input" 2> /dev/null
+    for chunk in "$dir"/chunk_*; do
+        length=$(wc -c < "$chunk")
+        if [ "$length" -gt $size ]; then
+            echo "FAIL: ${boundary:-fixed} chunk $(basename "$chunk") has $length bytes" >&2
+            exit 1
+        fi
+    done
+    if ! cat "$dir"/chunk_* | cmp -s - "$input"; then
+        echo "FAIL: ${boundary:-fixed} chunks do not add up to the input" >&2
+        exit 1
+    fi
+done
+echo "PASS: tail chunks stay within chunk_size"
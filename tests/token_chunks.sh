@@ -0,0 +1,35 @@
+#!/bin/sh
+# --tokens must keep chunks to chunk_size tokens where one tokenizer piece
+# holds more, like a CJK paragraph without spaces, in head and tail layout,
+# and also once a chunk is full, down to one token per chunk.
+#
+# Usage: tests/token_chunks.sh path/to/xcli
+set -e
+
+xcli=${1:?usage: $0 path/to/xcli}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+input=$dir/input.txt
+
+# 3000 CJK characters in one piece (about a token each), then English
+printf '漢字%.0s' $(seq 1500) > "$input"
+printf '\n\n' >> "$input"
+printf 'The quick brown fox jumps over the lazy dog. %.0s' $(seq 20) >> "$input"
+
+# chunk_size and the fewest chunks it must give
+for run in "2000 2" "1 3000"; do
+    set -- $run
+    for tail in 0 1; do
+        "$xcli" --export=nul --tokens $tail $1 "$input" > "$dir/out" 2> /dev/null
+        chunks=$(tr -cd '\0' < "$dir/out" | wc -c)
+        if [ "$chunks" -lt $2 ]; then
+            echo "FAIL: --tokens $tail $1 gave $chunks chunks, expected at least $2" >&2
+            exit 1
+        fi
+        if ! tr -d '\0' < "$dir/out" | cmp -s - "$input"; then
+            echo "FAIL: --tokens $tail $1 chunks do not add up to the input" >&2
+            exit 1
+        fi
+    done
+done
+echo "PASS: token chunks split long pieces"
@@ -14,4 +14,5 @@ INCLUDEPATH += .
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 # Input
+HEADERS += src/cli/chunking.h
 SOURCES += src/gui.cpp src/cli/cli.cpp src/cli/xcli.cpp
@@ -1,5 +1,6 @@
 QT += core widgets gui
 CONFIG += c++17
 TARGET = token
+HEADERS += src/cli/chunking.h
 SOURCES += lang/cpp/token.cpp
 DESTDIR = bin